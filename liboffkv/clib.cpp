@@ -1,6 +1,7 @@
 #include <liboffkv/liboffkv.hpp>
 #include <new>
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <vector>
 
@@ -136,7 +137,7 @@ offkv_Handle offkv_open(const char *url, const char *prefix, int *p_errcode)
 int64_t offkv_create(offkv_Handle h, const char *key, const char *value, size_t nvalue, int flags)
 {
     try {
-        return unwrap_client(h)->create(key, std::string(value, nvalue), flags & OFFKV_LEASE);
+        return unwrap_client(h)->create(key, std::string(value, nvalue), (flags & OFFKV_LEASE) != 0);
     } catch (const std::exception &e) {
         return to_errcode(e);
     }
@@ -262,6 +263,10 @@ static offkv_TxnOpResult *dup_txn_results(const std::vector<liboffkv::TxnOpResul
             return {OFFKV_OP_CREATE, arg.version};
         case liboffkv::TxnOpResult::Kind::SET:
             return {OFFKV_OP_SET, arg.version};
+        case liboffkv::TxnOpResult::Kind::GET:
+        case liboffkv::TxnOpResult::Kind::GET_CHILDREN:
+            // the C API has no read ops
+            break;
         }
         UNREACHABLE();
     });
@@ -281,34 +286,40 @@ offkv_commit(
     offkv_TxnResult *p_result)
 {
     try {
-        std::vector<liboffkv::TxnCheck> checks_vec;
+        // the keys and values are only borrowed from the caller
+        std::vector<liboffkv::TxnCheckView> checks_vec;
         for (size_t i = 0; i < nchecks; ++i)
-            checks_vec.emplace_back(checks[i].key, checks[i].version);
+            checks_vec.push_back({checks[i].key, checks[i].version});
 
-        std::vector<liboffkv::TxnOp> ops_vec;
+        std::vector<liboffkv::TxnOpView> ops_vec;
         for (size_t i = 0; i < nops; ++i)
             switch (ops[i].op) {
             case OFFKV_OP_CREATE:
-                ops_vec.push_back(liboffkv::TxnOpCreate(
+                ops_vec.push_back({
+                    liboffkv::TxnOpView::Kind::CREATE,
                     ops[i].key,
-                    std::string(ops[i].value, ops[i].nvalue),
-                    ops[i].flags & OFFKV_LEASE
-                ));
+                    std::string_view(ops[i].value, ops[i].nvalue),
+                    (ops[i].flags & OFFKV_LEASE) != 0
+                });
                 break;
             case OFFKV_OP_SET:
-                ops_vec.push_back(liboffkv::TxnOpSet(
+                ops_vec.push_back({
+                    liboffkv::TxnOpView::Kind::SET,
                     ops[i].key,
-                    std::string(ops[i].value, ops[i].nvalue)
-                ));
+                    std::string_view(ops[i].value, ops[i].nvalue)
+                });
                 break;
             case OFFKV_OP_ERASE:
-                ops_vec.push_back(liboffkv::TxnOpErase(ops[i].key));
+                ops_vec.push_back({liboffkv::TxnOpView::Kind::ERASE, ops[i].key});
                 break;
             default:
                 UNREACHABLE();
             }
 
-        auto r = unwrap_client(h)->commit({checks_vec, ops_vec});
+        auto r = unwrap_client(h)->commit(liboffkv::TransactionView{
+            checks_vec.data(), checks_vec.size(),
+            ops_vec.data(), ops_vec.size()
+        });
         if (p_result)
             *p_result = {dup_txn_results(r), r.size(), static_cast<size_t>(-1)};
         return 0;
@@ -4,9 +4,22 @@
 #include <string>
 #include <memory>
 #include <variant>
+#include <optional>
 #include <utility>
 #include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <functional>
+#include <type_traits>
+#include <map>
+#include <set>
+#include <random>
+#include <thread>
+#include <stdexcept>
+#include <string_view>
+#include <memory_resource>
 #include "key.hpp"
+#include "errors.hpp"
 
 namespace liboffkv {
 
@@ -17,6 +30,55 @@ public:
     virtual ~WatchHandle() = default;
 };
 
+// The state of a key after a change: its new version and value, or
+// version 0 (and an empty value) if the key was erased.
+struct WatchedValue
+{
+    int64_t version;
+    std::string value;
+
+    operator bool() const { return version != 0; }
+};
+
+class ValueWatchHandle
+{
+public:
+    virtual WatchedValue wait() = 0;
+    virtual ~ValueWatchHandle() = default;
+};
+
+// Children added and removed since the previous notification.
+struct ChildrenDelta
+{
+    std::vector<std::string> added;
+    std::vector<std::string> removed;
+
+    bool empty() const { return added.empty() && removed.empty(); }
+};
+
+class ChildrenWatchHandle
+{
+public:
+    // Blocks until some children are added or removed, may be called repeatedly.
+    virtual ChildrenDelta wait() = 0;
+    virtual ~ChildrenWatchHandle() = default;
+};
+
+// A change of a key in a watched subtree: its new version, or 0 if the key was erased.
+struct SubtreeChange
+{
+    std::string key;
+    int64_t version;
+};
+
+class SubtreeWatchHandle
+{
+public:
+    // Blocks until some keys of the subtree change, may be called repeatedly.
+    virtual std::vector<SubtreeChange> wait() = 0;
+    virtual ~SubtreeWatchHandle() = default;
+};
+
 struct ExistsResult
 {
     int64_t version;
@@ -31,6 +93,39 @@ struct ChildrenResult
     std::unique_ptr<WatchHandle> watch;
 };
 
+// Asks get_children for the first <limit> children in the order of their names; 0 means all of them.
+struct ChildrenQuery
+{
+    enum class Order
+    {
+        NONE,
+        ASCEND,
+        DESCEND,
+    };
+
+    Order order = Order::NONE;
+    size_t limit = 0;
+};
+
+struct ChildrenWatchResult
+{
+    std::vector<std::string> children;
+    std::unique_ptr<ChildrenWatchHandle> watch;
+};
+
+struct StatResult
+{
+    int64_t version;
+    // backend-specific revisions (zxid, etcd revision, Consul index) of the creation and the last change
+    int64_t create_revision;
+    int64_t modify_revision;
+    // unknown with etcd, whose ranges return either the whole value or no value at all
+    std::optional<size_t> value_size;
+    size_t children_count;
+    // the lease, session or ephemeral owner the key belongs to, empty if it is not leased
+    std::string owner;
+};
+
 struct GetResult
 {
     int64_t version;
@@ -38,34 +133,108 @@ struct GetResult
     std::unique_ptr<WatchHandle> watch;
 };
 
+// The value is only transferred if the version differs from the known one.
+struct GetIfChangedResult
+{
+    int64_t version;
+    std::optional<std::string> value;
+
+    bool changed() const { return value.has_value(); }
+};
+
+struct ValueWatchResult
+{
+    int64_t version;
+    std::string value;
+    std::unique_ptr<ValueWatchHandle> watch;
+};
+
 struct CasResult
 {
     int64_t version;
+    // on a mismatch, the state of the key that caused it, so that a retry needs no extra get;
+    // the version is 0 if the key has been erased since
+    int64_t current_version = 0;
+    std::string current_value = {};
 
     operator bool() const { return version != 0; }
 };
 
+// Ties a created key to the liveness of the client. Leases with equal TTLs form a group that
+// shares one etcd lease or Consul session; ZooKeeper keeps all of them in its session.
+class Lease
+{
+public:
+    static constexpr auto DEFAULT_TTL = std::chrono::seconds(10);
+
+    Lease(bool leased = false)
+        : ttl_{leased ? DEFAULT_TTL : std::chrono::seconds::zero()}
+    {}
+
+    explicit Lease(std::chrono::seconds ttl)
+        : ttl_{ttl}
+    {}
+
+    // create(key, value, 5) must not silently mean a lease with the default TTL
+    template<class T, class = std::enable_if_t<std::is_arithmetic_v<T>>>
+    Lease(T) = delete;
+
+    std::chrono::seconds ttl() const { return ttl_; }
+
+    operator bool() const { return ttl_ > std::chrono::seconds::zero(); }
+
+private:
+    std::chrono::seconds ttl_;
+};
+
 struct TxnCheck
 {
+    enum class Kind
+    {
+        // the version equals `version` (or the key just exists if it is 0)
+        VERSION,
+        // the value equals `value`
+        VALUE,
+        // the value starts with `value`
+        VALUE_PREFIX,
+        // the key does not exist; ZooKeeper can only look it up right before the commit
+        ABSENT,
+    };
+
     Key key;
     int64_t version;
+    Kind kind = Kind::VERSION;
+    std::string value;
 
     TxnCheck(Key key_, int64_t version_)
         : key(std::move(key_))
         , version{version_}
     {}
+
+    TxnCheck(Key key_, Kind kind_, std::string value_)
+        : key(std::move(key_))
+        , version{0}
+        , kind{kind_}
+        , value(std::move(value_))
+    {}
+
+    // whether the given value of the key passes a VALUE or VALUE_PREFIX check
+    bool matches(const std::string& actual) const
+    {
+        return kind == Kind::VALUE ? actual == value : actual.compare(0, value.size(), value) == 0;
+    }
 };
 
 struct TxnOpCreate
 {
     Key key;
     std::string value;
-    bool lease;
+    Lease lease;
 
-    TxnOpCreate(Key key_, std::string value_, bool lease_ = false)
+    TxnOpCreate(Key key_, std::string value_, Lease lease_ = {})
         : key(std::move(key_))
         , value(std::move(value_))
-        , lease{lease_}
+        , lease(lease_)
     {}
 };
 
@@ -89,7 +258,27 @@ struct TxnOpErase
     {}
 };
 
-using TxnOp = std::variant<TxnOpCreate, TxnOpSet, TxnOpErase>;
+// Reads the value of the key as part of the transaction.
+struct TxnOpGet
+{
+    Key key;
+
+    explicit TxnOpGet(Key key_)
+        : key(std::move(key_))
+    {}
+};
+
+// Reads the list of direct children of the key as part of the transaction.
+struct TxnOpGetChildren
+{
+    Key key;
+
+    explicit TxnOpGetChildren(Key key_)
+        : key(std::move(key_))
+    {}
+};
+
+using TxnOp = std::variant<TxnOpCreate, TxnOpSet, TxnOpErase, TxnOpGet, TxnOpGetChildren>;
 
 struct TxnOpResult
 {
@@ -97,21 +286,265 @@ struct TxnOpResult
     {
         CREATE,
         SET,
+        GET,
+        GET_CHILDREN,
     };
 
     Kind kind;
+    // the version of the key after the operation; 0 for GET_CHILDREN
     int64_t version;
+    // GET only
+    std::string value;
+    // GET_CHILDREN only
+    std::vector<std::string> children;
 };
 
 
 using TransactionResult = std::vector<TxnOpResult>;
 
+
+// Counterparts of the result types allocated from a caller's memory resource, e.g. a
+// std::pmr::monotonic_buffer_resource per request. Watches are not supported by them.
+struct PmrGetResult
+{
+    int64_t version;
+    std::pmr::string value;
+};
+
+using PmrChildren = std::pmr::vector<std::pmr::string>;
+
+struct PmrTxnOpResult
+{
+    TxnOpResult::Kind kind;
+    int64_t version;
+    std::pmr::string value;
+    PmrChildren children;
+};
+
+using PmrTransactionResult = std::pmr::vector<PmrTxnOpResult>;
+
 struct Transaction {
     std::vector<TxnCheck> checks;
     std::vector<TxnOp> ops;
 };
 
 
+// Non-owning counterparts of the transaction types: keys and values are borrowed for the
+// duration of the commit, so large values are copied only once, into the backend's request.
+struct TxnCheckView
+{
+    std::string_view key;
+    int64_t version;
+    TxnCheck::Kind kind = TxnCheck::Kind::VERSION;
+    std::string_view value = {};
+};
+
+struct TxnOpView
+{
+    enum class Kind
+    {
+        CREATE,
+        SET,
+        ERASE,
+        GET,
+        GET_CHILDREN,
+    };
+
+    Kind kind;
+    std::string_view key;
+    std::string_view value = {};
+    Lease lease = {};
+};
+
+struct TransactionView
+{
+    const TxnCheckView *checks;
+    size_t nchecks;
+    const TxnOpView *ops;
+    size_t nops;
+};
+
+namespace detail {
+
+// Copies the view; without values, the create and set ops get empty ones to be filled in later.
+inline Transaction to_transaction(const TransactionView &view, bool with_values = true)
+{
+    Transaction transaction;
+    transaction.checks.reserve(view.nchecks);
+    for (size_t i = 0; i < view.nchecks; ++i) {
+        const auto &check = view.checks[i];
+        if (check.kind == TxnCheck::Kind::VERSION)
+            transaction.checks.emplace_back(std::string(check.key), check.version);
+        else
+            transaction.checks.emplace_back(std::string(check.key), check.kind, std::string(check.value));
+    }
+
+    transaction.ops.reserve(view.nops);
+    for (size_t i = 0; i < view.nops; ++i) {
+        const auto &op = view.ops[i];
+        std::string value = with_values ? std::string(op.value) : std::string();
+        switch (op.kind) {
+            case TxnOpView::Kind::CREATE:
+                transaction.ops.emplace_back(TxnOpCreate(std::string(op.key), std::move(value), op.lease));
+                break;
+            case TxnOpView::Kind::SET:
+                transaction.ops.emplace_back(TxnOpSet(std::string(op.key), std::move(value)));
+                break;
+            case TxnOpView::Kind::ERASE:
+                transaction.ops.emplace_back(TxnOpErase(std::string(op.key)));
+                break;
+            case TxnOpView::Kind::GET:
+                transaction.ops.emplace_back(TxnOpGet(std::string(op.key)));
+                break;
+            case TxnOpView::Kind::GET_CHILDREN:
+                transaction.ops.emplace_back(TxnOpGetChildren(std::string(op.key)));
+                break;
+        }
+    }
+    return transaction;
+}
+
+} // namespace detail
+
+
+// The health of the lease (etcd) or session (Consul) that keeps leased keys alive.
+struct LeaseStatus {
+    // how long the last renewal took to be acknowledged
+    std::chrono::milliseconds latency;
+    // time left until the lease expires unless it is renewed again
+    std::chrono::milliseconds margin;
+    // the lease has expired or can no longer be renewed, leased keys are gone
+    bool lost;
+};
+
+using LeaseWarningHandler = std::function<void(const LeaseStatus&)>;
+
+
+namespace detail {
+
+// Exponential backoff with full jitter: each wait is random up to a bound that doubles
+// every time, so that conflicting clients spread out instead of retrying in lockstep.
+class Backoff
+{
+public:
+    explicit Backoff(std::chrono::microseconds initial = std::chrono::milliseconds(1),
+                     std::chrono::microseconds max = std::chrono::milliseconds(100))
+        : initial_{initial}
+        , bound_{initial}
+        , max_{max}
+        , random_{std::random_device{}()}
+    {}
+
+    // the next wait, for the callers that cannot sleep
+    std::chrono::microseconds next()
+    {
+        std::uniform_int_distribution<std::chrono::microseconds::rep> distribution(0, bound_.count());
+        bound_ = std::min(bound_ * 2, max_);
+        return std::chrono::microseconds(distribution(random_));
+    }
+
+    void wait()
+    {
+        std::this_thread::sleep_for(next());
+    }
+
+    void reset()
+    {
+        bound_ = initial_;
+    }
+
+private:
+    std::chrono::microseconds initial_;
+    std::chrono::microseconds bound_;
+    std::chrono::microseconds max_;
+    std::mt19937 random_;
+};
+
+} // namespace detail
+
+
+class Client;
+
+// A transaction whose keys and structure are fixed once, so that only the versions of the
+// checks and the values of the create and set ops are supplied on every commit. It must not
+// outlive the client that has prepared it.
+class PreparedTransaction
+{
+public:
+    // versions[i] is the version for the i-th check (ignored unless it is a VERSION check),
+    // values[j] is the value for the j-th create or set op
+    virtual TransactionResult commit(const std::vector<int64_t> &versions,
+                                     const std::vector<std::string> &values) = 0;
+
+    virtual ~PreparedTransaction() = default;
+
+protected:
+    static void bind_(Transaction &transaction,
+                      const std::vector<int64_t> &versions,
+                      const std::vector<std::string> &values)
+    {
+        if (versions.size() != transaction.checks.size())
+            throw std::invalid_argument("wrong number of versions for a prepared transaction");
+
+        for (size_t i = 0; i < versions.size(); ++i)
+            transaction.checks[i].version = versions[i];
+
+        size_t j = 0;
+        for (auto &op : transaction.ops) {
+            std::string *value = nullptr;
+            if (auto create = std::get_if<TxnOpCreate>(&op)) value = &create->value;
+            else if (auto set = std::get_if<TxnOpSet>(&op)) value = &set->value;
+            if (!value) continue;
+
+            if (j == values.size())
+                throw std::invalid_argument("wrong number of values for a prepared transaction");
+            *value = values[j++];
+        }
+        if (j != values.size())
+            throw std::invalid_argument("wrong number of values for a prepared transaction");
+    }
+};
+
+// One attempt of Client::transact. Reads go to the client and are checked by version at the
+// commit, writes are buffered until it. A key that has been written is read back from the
+// buffer; erasing a key does not hide its descendants from get().
+class TransactionContext
+{
+public:
+    // the values read by the previous attempts, version 0 if the key was missing;
+    // a conflict evicts the key it happened on
+    using Snapshot = std::map<std::string, std::pair<int64_t, std::string>>;
+
+    // throws NoEntry if the key does not exist; the absence is checked at commit as well
+    std::string get(const Key &key);
+
+    void create(const Key &key, std::string value, Lease lease = {});
+
+    void set(const Key &key, std::string value);
+
+    void erase(const Key &key);
+
+private:
+    friend class Client;
+
+    TransactionContext(Client &client, Snapshot &snapshot)
+        : client_(client)
+        , snapshot_(snapshot)
+    {}
+
+    // false if one of the reads turned out to be stale
+    bool commit_();
+
+    Client &client_;
+    Snapshot &snapshot_;
+    std::vector<TxnCheck> checks_;
+    std::set<std::string> checked_;
+    std::vector<TxnOp> ops_;
+    // the values written by this attempt, empty if erased
+    std::map<std::string, std::optional<std::string>> written_;
+};
+
+
 class Client
 {
 protected:
@@ -122,23 +555,230 @@ public:
         : prefix_{std::move(prefix)}
     {}
 
-    virtual int64_t create(const Key &key, const std::string &value, bool lease = false) = 0;
+    // A leased key is erased once the client stops renewing the lease, see Lease.
+    virtual int64_t create(const Key &key, const std::string &value, Lease lease = {}) = 0;
+
+    // Creates a key that is erased once the ttl passes, whether or not the client is still alive.
+    // On etcd keys created at about the same time share a lease, so one can outlive its ttl by
+    // max(1s, ttl/16). Consul raises the ttl to 10s and may invalidate a session up to twice its
+    // ttl late. Not supported by ZooKeeper.
+    virtual int64_t create(const Key &key, const std::string &value, std::chrono::seconds ttl) = 0;
+
+    // Creates a child of the parent named after a counter that grows with every such call and
+    // returns the name. Names are zero-padded, so they sort in creation order.
+    virtual std::string create_sequential(const Key &parent, const std::string &value, Lease lease = {}) = 0;
 
     virtual ExistsResult exists(const Key &key, bool watch = false) = 0;
 
+    // All the metadata of the key at once; throws NoEntry if it does not exist.
+    virtual StatResult stat(const Key &key) = 0;
+
     virtual ChildrenResult get_children(const Key &key, bool watch = false) = 0;
 
+    // Sorting and limiting is done by the server where possible, so the head of a huge
+    // directory can be found without transferring all of it.
+    virtual std::vector<std::string> get_children(const Key &key, const ChildrenQuery &query) = 0;
+
+    virtual PmrChildren get_children(const Key &key, std::pmr::memory_resource *resource)
+    {
+        auto result = get_children(key);
+        PmrChildren children(resource);
+        children.reserve(result.children.size());
+        for (const auto &child : result.children)
+            children.emplace_back(child);
+        return children;
+    }
+
+    virtual size_t count_children(const Key &key) = 0;
+
+    // Counts the descendants of the key at any depth, the key itself excluded.
+    virtual size_t count_subtree(const Key &key) = 0;
+
+    // Lists the children and keeps reporting the changes among them, so the list never has
+    // to be fetched again.
+    virtual ChildrenWatchResult watch_children(const Key &key) = 0;
+
+    // Reports the changes of all the descendants of the key, at any depth.
+    virtual std::unique_ptr<SubtreeWatchHandle> watch_subtree(const Key &key) = 0;
+
     virtual int64_t set(const Key &key, const std::string &value) = 0;
 
     virtual GetResult get(const Key &key, bool watch = false) = 0;
 
+    // Unless the backend builds the result in the resource directly, the plain one is copied into it.
+    virtual PmrGetResult get(const Key &key, std::pmr::memory_resource *resource)
+    {
+        auto result = get(key);
+        return {result.version, std::pmr::string(result.value, resource)};
+    }
+
+    virtual GetIfChangedResult get_if_changed(const Key &key, int64_t known_version) = 0;
+
+    // Same as get(key, true), but the watch reports the new value and version of the key.
+    virtual ValueWatchResult watch_value(const Key &key) = 0;
+
     virtual CasResult cas(const Key &key, const std::string &value, int64_t version = 0) = 0;
 
     virtual void erase(const Key &key, int64_t version = 0) = 0;
 
     virtual TransactionResult commit(const Transaction&) = 0;
 
+    // Unless the backend can encode the view directly, it is copied into a Transaction first.
+    virtual TransactionResult commit(const TransactionView &view)
+    {
+        return commit(detail::to_transaction(view));
+    }
+
+    // Only the result is moved to the resource, the commit itself allocates as usual.
+    PmrTransactionResult commit(const Transaction &transaction, std::pmr::memory_resource *resource)
+    {
+        PmrTransactionResult result(resource);
+        for (const auto &op : commit(transaction)) {
+            PmrChildren children(op.children.begin(), op.children.end(), resource);
+            result.push_back({op.kind, op.version, std::pmr::string(op.value, resource), std::move(children)});
+        }
+        return result;
+    }
+
+    // The values and versions in the shape are placeholders, see PreparedTransaction. Unless
+    // the backend can encode the transaction in advance, it is simply filled in and committed.
+    virtual std::unique_ptr<PreparedTransaction> prepare(Transaction shape);
+
+    // Runs fn(TransactionContext&) and commits its writes, checking that no key it has read
+    // has changed; on a conflict fn is run again after a backoff. A key found missing is checked
+    // to be still missing; ZooKeeper can only look it up right before the commit, but a concurrent
+    // create of it that fails fn's own create is retried too. fn must have no side effects besides
+    // the context.
+    // Returns what fn returns. A failed write throws TxnFailed with the index of the write among
+    // those made by fn.
+    template <class F>
+    std::invoke_result_t<F&, TransactionContext&> transact(F fn)
+    {
+        TransactionContext::Snapshot snapshot;
+        detail::Backoff backoff;
+        while (true) {
+            TransactionContext context(*this, snapshot);
+            if constexpr (std::is_void_v<std::invoke_result_t<F&, TransactionContext&>>) {
+                fn(context);
+                if (context.commit_()) return;
+            } else {
+                auto result = fn(context);
+                if (context.commit_()) return result;
+            }
+            backoff.wait();
+        }
+    }
+
+    // The handler is called from a background thread each time the renewal margin of the lease
+    // drops below min_margin, and once the lease is lost.
+    virtual void set_lease_warning_handler(std::chrono::milliseconds min_margin, LeaseWarningHandler handler) = 0;
+
     virtual ~Client() = default;
 };
 
+
+namespace detail {
+
+class BoundTransaction : public PreparedTransaction
+{
+public:
+    BoundTransaction(Client &client, Transaction shape)
+        : client_(client)
+        , shape_(std::move(shape))
+    {}
+
+    TransactionResult commit(const std::vector<int64_t> &versions,
+                             const std::vector<std::string> &values) override
+    {
+        auto transaction = shape_;
+        bind_(transaction, versions, values);
+        return client_.commit(transaction);
+    }
+
+private:
+    Client &client_;
+    Transaction shape_;
+};
+
+} // namespace detail
+
+inline std::unique_ptr<PreparedTransaction> Client::prepare(Transaction shape)
+{
+    return std::make_unique<detail::BoundTransaction>(*this, std::move(shape));
+}
+
+
+inline std::string TransactionContext::get(const Key &key)
+{
+    const auto name = static_cast<std::string>(key);
+    if (auto written = written_.find(name); written != written_.end()) {
+        if (!written->second) throw NoEntry{};
+        return *written->second;
+    }
+
+    auto cached = snapshot_.find(name);
+    if (cached == snapshot_.end()) {
+        try {
+            auto result = client_.get(key);
+            cached = snapshot_.emplace(name, std::make_pair(result.version, std::move(result.value))).first;
+        } catch (const NoEntry&) {
+            cached = snapshot_.emplace(name, std::make_pair(int64_t{0}, std::string{})).first;
+        }
+    }
+
+    const bool missing = cached->second.first == 0;
+    if (checked_.insert(name).second) {
+        if (missing)
+            checks_.emplace_back(key, TxnCheck::Kind::ABSENT, std::string{});
+        else
+            checks_.emplace_back(key, cached->second.first);
+    }
+    if (missing) throw NoEntry{};
+    return cached->second.second;
+}
+
+inline void TransactionContext::create(const Key &key, std::string value, Lease lease)
+{
+    written_[static_cast<std::string>(key)] = value;
+    ops_.emplace_back(TxnOpCreate(key, std::move(value), lease));
+}
+
+inline void TransactionContext::set(const Key &key, std::string value)
+{
+    written_[static_cast<std::string>(key)] = value;
+    ops_.emplace_back(TxnOpSet(key, std::move(value)));
+}
+
+inline void TransactionContext::erase(const Key &key)
+{
+    written_[static_cast<std::string>(key)] = std::nullopt;
+    ops_.emplace_back(TxnOpErase(key));
+}
+
+inline bool TransactionContext::commit_()
+{
+    if (checks_.empty() && ops_.empty())
+        return true;
+
+    try {
+        client_.commit({checks_, ops_});
+        return true;
+    } catch (const TxnFailed &e) {
+        if (e.failed_op() >= checks_.size()) {
+            const size_t op_index = e.failed_op() - checks_.size();
+            // a key read as missing has been created since, which the check could not see
+            if (const auto *create = std::get_if<TxnOpCreate>(&ops_[op_index])) {
+                auto cached = snapshot_.find(static_cast<std::string>(create->key));
+                if (cached != snapshot_.end() && cached->second.first == 0) {
+                    snapshot_.erase(cached);
+                    return false;
+                }
+            }
+            throw TxnFailed{op_index};
+        }
+        snapshot_.erase(static_cast<std::string>(checks_[e.failed_op()].key));
+        return false;
+    }
+}
+
 } // namespace liboffkv
@@ -8,6 +8,11 @@
 #include <utility>
 #include <type_traits>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <map>
 #include <stdint.h>
 #include <stddef.h>
 
@@ -22,14 +27,28 @@ class ConsulClient : public Client
 {
 private:
     static constexpr auto WATCH_TIMEOUT = std::chrono::seconds(120);
-    static constexpr auto TTL = std::chrono::seconds(10);
+    static constexpr auto MIN_TTL = std::chrono::seconds(10);
+    // "parent//sequence" holds the counter of create_sequential
+    static constexpr auto SEQUENCE_KEY_SUFFIX = "/sequence";
     static constexpr auto CONSISTENCY = ppconsul::Consistency::Consistent;
 
     ppconsul::Consul client_;
     ppconsul::kv::Kv kv_;
     std::string address_;
-    std::string session_id_;
-    detail::PingSender ping_sender_;
+    std::shared_ptr<detail::LeaseMonitor> lease_monitor_;
+
+    struct Session_
+    {
+        std::string id;
+        std::shared_ptr<std::atomic<bool>> lost;
+        detail::PingSender ping_sender;
+    };
+
+    std::mutex sessions_lock_;
+    // one session per lease TTL
+    std::map<std::chrono::seconds, Session_> sessions_;
+    // sessions that are never renewed
+    detail::ExpiryPool<std::string> expiring_sessions_;
 
     [[noreturn]] static void rethrow_(const ppconsul::Error &e)
     {
@@ -49,6 +68,26 @@ private:
         return result;
     }
 
+    // keys used by the client itself, see SEQUENCE_KEY_SUFFIX
+    static bool is_hidden_(const std::string &key_string)
+    {
+        return key_string.find("//") != std::string::npos;
+    }
+
+    // a key listing with the '/' separator also has "key/child/" entries for children with descendants
+    static size_t count_child_keys_(const std::vector<std::string> &keys)
+    {
+        return std::count_if(keys.begin(), keys.end(), [](const std::string &child_key) {
+            return child_key.back() != '/';
+        });
+    }
+
+    // "prefix/a/b" -> "/a/b"
+    static std::string unwrap_key_(const std::string &key_string, size_t nglobal_prefix)
+    {
+        return nglobal_prefix ? key_string.substr(nglobal_prefix) : "/" + key_string;
+    }
+
     class ConsulWatchHandle_ : public WatchHandle
     {
         ppconsul::Consul client_;
@@ -83,6 +122,169 @@ private:
         }
     };
 
+    class ConsulValueWatchHandle_ : public ValueWatchHandle
+    {
+        ppconsul::Consul client_;
+        ppconsul::kv::Kv kv_;
+        std::string key_;
+        uint64_t old_version_;
+
+    public:
+        ConsulValueWatchHandle_(const std::string &address, std::string key, uint64_t old_version)
+            : client_(address)
+            , kv_(client_, ppconsul::kw::consistency = CONSISTENCY)
+            , key_(std::move(key))
+            , old_version_{old_version}
+        {}
+
+        WatchedValue wait() override
+        {
+            try {
+                while (true) {
+                    auto item = kv_.item(
+                        ppconsul::withHeaders,
+                        key_,
+                        ppconsul::kv::kw::block_for = {WATCH_TIMEOUT, old_version_});
+                    if (!item.data().valid())
+                        return {0, {}};
+                    // the index stays the same if the blocking query has timed out
+                    const uint64_t version = item.headers().index();
+                    if (version != old_version_)
+                        return {static_cast<int64_t>(version), std::move(item.data().value)};
+                }
+            } catch (const ppconsul::Error &e) {
+                rethrow_(e);
+            }
+        }
+    };
+
+    // a blocking query returns the whole list of keys,
+    // so the handle keeps the last listing to compute the delta;
+    // the parent is looked up after each change to notice it being erased
+    class ConsulChildrenWatchHandle_ : public ChildrenWatchHandle
+    {
+        ppconsul::Consul client_;
+        ppconsul::kv::Kv kv_;
+        std::string parent_;
+        std::string child_prefix_;
+        size_t nglobal_prefix_;
+        std::vector<std::string> children_;
+        uint64_t old_version_;
+
+    public:
+        ConsulChildrenWatchHandle_(
+                    const std::string &address,
+                    std::string parent,
+                    size_t nglobal_prefix,
+                    std::vector<std::string> children,
+                    uint64_t old_version)
+            : client_(address)
+            , kv_(client_, ppconsul::kw::consistency = CONSISTENCY)
+            , parent_(std::move(parent))
+            , child_prefix_(parent_ + "/")
+            , nglobal_prefix_{nglobal_prefix}
+            , children_(std::move(children))
+            , old_version_{old_version}
+        {
+            std::sort(children_.begin(), children_.end());
+        }
+
+        ChildrenDelta wait() override
+        {
+            try {
+                while (true) {
+                    // only the direct children are listed, the ones with descendants also as "child/"
+                    auto keys = kv_.subKeys(
+                        ppconsul::withHeaders,
+                        child_prefix_,
+                        '/',
+                        ppconsul::kv::kw::block_for = {WATCH_TIMEOUT, old_version_});
+                    old_version_ = keys.headers().index();
+
+                    // erasing a parent without children only shows up once the query times out
+                    if (!kv_.item(parent_).valid())
+                        throw NoEntry{};
+
+                    std::vector<std::string> children;
+                    for (const auto &key : keys.data())
+                        if (key.back() != '/')
+                            children.emplace_back(unwrap_key_(key, nglobal_prefix_));
+                    std::sort(children.begin(), children.end());
+
+                    auto delta = detail::diff_children(children_, children);
+                    children_ = std::move(children);
+                    if (!delta.empty())
+                        return delta;
+                }
+            } catch (const ppconsul::Error &e) {
+                rethrow_(e);
+            }
+        }
+    };
+
+    // blocks on the whole key prefix; only the items carry their modify indices,
+    // so the handle keeps them to tell which keys have changed
+    class ConsulSubtreeWatchHandle_ : public SubtreeWatchHandle
+    {
+        ppconsul::Consul client_;
+        ppconsul::kv::Kv kv_;
+        std::string subtree_prefix_;
+        size_t nglobal_prefix_;
+        std::map<std::string, uint64_t> versions_;
+        uint64_t old_version_;
+
+    public:
+        ConsulSubtreeWatchHandle_(
+                    const std::string &address,
+                    std::string subtree_prefix,
+                    size_t nglobal_prefix,
+                    std::map<std::string, uint64_t> versions,
+                    uint64_t old_version)
+            : client_(address)
+            , kv_(client_, ppconsul::kw::consistency = CONSISTENCY)
+            , subtree_prefix_(std::move(subtree_prefix))
+            , nglobal_prefix_{nglobal_prefix}
+            , versions_(std::move(versions))
+            , old_version_{old_version}
+        {}
+
+        std::vector<SubtreeChange> wait() override
+        {
+            try {
+                while (true) {
+                    auto items = kv_.items(
+                        ppconsul::withHeaders,
+                        subtree_prefix_,
+                        ppconsul::kv::kw::block_for = {WATCH_TIMEOUT, old_version_});
+                    old_version_ = items.headers().index();
+
+                    std::vector<SubtreeChange> changes;
+                    std::map<std::string, uint64_t> versions;
+                    for (const auto &item : items.data()) {
+                        if (is_hidden_(item.key))
+                            continue;
+                        versions.emplace(item.key, item.modifyIndex);
+                        auto it = versions_.find(item.key);
+                        if (it == versions_.end() || it->second != item.modifyIndex)
+                            changes.push_back({
+                                unwrap_key_(item.key, nglobal_prefix_),
+                                static_cast<int64_t>(item.modifyIndex)
+                            });
+                    }
+                    for (const auto &[key, _] : versions_)
+                        if (!versions.count(key))
+                            changes.push_back({unwrap_key_(key, nglobal_prefix_), 0});
+
+                    versions_ = std::move(versions);
+                    if (!changes.empty())
+                        return changes;
+                }
+            } catch (const ppconsul::Error &e) {
+                rethrow_(e);
+            }
+        }
+    };
+
     std::unique_ptr<WatchHandle> make_watch_handle_(
         const std::string &key,
         uint64_t old_version,
@@ -91,43 +293,97 @@ private:
         return std::make_unique<ConsulWatchHandle_>(address_, key, old_version, all_with_prefix);
     }
 
-    void create_session_if_needed_()
+    // returns the session of the lease group, creating it if needed
+    std::string session_for_(const Lease &lease)
     {
-        if (!session_id_.empty())
-            return;
+        // Consul does not accept session TTLs below 10 seconds
+        const auto ttl = std::max(lease.ttl(), MIN_TTL);
+
+        std::lock_guard<std::mutex> lock(sessions_lock_);
+        auto &session = sessions_[ttl];
+        // a lost session is replaced, the keys locked by it are gone anyway
+        if (!session.id.empty() && !*session.lost)
+            return session.id;
+
         auto client = std::make_unique<ppconsul::Consul>(address_);
         auto sessions = std::make_unique<ppconsul::sessions::Sessions>(*client);
 
-        session_id_ = sessions->create(
+        session.id = sessions->create(
             ppconsul::sessions::kw::lock_delay = std::chrono::seconds{0},
             ppconsul::sessions::kw::behavior = ppconsul::sessions::InvalidationBehavior::Delete,
-            ppconsul::sessions::kw::ttl = TTL);
+            ppconsul::sessions::kw::ttl = ttl);
+
+        session.lost = std::make_shared<std::atomic<bool>>(false);
 
-        ping_sender_ = detail::PingSender(
-            (TTL + std::chrono::seconds(1)) / 2,
-            [client = std::move(client), sessions = std::move(sessions), id = session_id_]()
+        using Clock = std::chrono::steady_clock;
+        const auto as_millis = [](Clock::duration d) {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(d);
+        };
+
+        session.ping_sender = detail::PingSender(
+            (ttl + std::chrono::seconds(1)) / 2,
+            [client = std::move(client), sessions = std::move(sessions), id = session.id, ttl,
+             lost = session.lost, monitor = lease_monitor_, as_millis, renewed_at = Clock::now()]() mutable
             {
+                if (*lost)
+                    return ttl;
+
+                const auto started_at = Clock::now();
                 try {
                     sessions->renew(id);
-                    return (TTL + std::chrono::seconds(1)) / 2;
+                    const auto now = Clock::now();
+                    renewed_at = started_at;
+                    monitor->report({as_millis(now - started_at), as_millis(renewed_at + ttl - now), false});
+                    return (ttl + std::chrono::seconds(1)) / 2;
                 } catch (... /* BadStatus& ? */) {
-                    return std::chrono::seconds::zero();
+                    const auto now = Clock::now();
+                    if (now >= renewed_at + ttl) {
+                        *lost = true;
+                        monitor->report({std::chrono::milliseconds::zero(), std::chrono::milliseconds::zero(), true});
+                        return ttl;
+                    }
+                    // retry while the session may still be alive
+                    monitor->report({as_millis(now - started_at), as_millis(renewed_at + ttl - now), false});
+                    return std::chrono::seconds(1);
                 }
             }
         );
+
+        return session.id;
     }
 
-public:
-    ConsulClient(const std::string &address, Path prefix)
-        : Client(std::move(prefix))
-        , client_(address)
-        , kv_(client_, ppconsul::kw::consistency = CONSISTENCY)
-        , address_{address}
-        , session_id_{}
-        , ping_sender_{}
-    {}
+    // returns the children and the index to block on
+    std::pair<std::vector<std::string>, uint64_t> list_children_(const std::string &key_string)
+    {
+        const std::string child_prefix = key_string + "/";
+        try {
+            auto result = kv_.commit({
+                ppconsul::kv::txn_ops::GetAll{child_prefix},
+                ppconsul::kv::txn_ops::Get{key_string},
+            });
+
+            std::vector<std::string> children;
+            uint64_t max_modify_index = result.back().modifyIndex;
+            const auto nchild_prefix = child_prefix.size();
+            const auto nglobal_prefix = as_path_string_(Path{""}).size();
+            for (auto it = result.begin(), end = --result.end(); it != end; ++it) {
+                max_modify_index = std::max(max_modify_index, it->modifyIndex);
+                if (it->key.find('/', nchild_prefix) == std::string::npos)
+                    children.emplace_back(unwrap_key_(it->key, nglobal_prefix));
+            }
+
+            return {std::move(children), max_modify_index};
+
+        } catch (const ppconsul::kv::TxnAborted &) {
+            throw NoEntry{};
 
-    int64_t create(const Key &key, const std::string &value, bool lease = false) override
+        } catch (const ppconsul::Error &e) {
+            rethrow_(e);
+        }
+    }
+
+    // the key is locked by the session unless session_id is empty
+    int64_t create_(const Key &key, const std::string &value, const std::string &session_id)
     {
         std::vector<ppconsul::kv::TxnOperation> txn;
 
@@ -140,9 +396,8 @@ public:
         const std::string key_string = as_path_string_(key);
         txn.push_back(ppconsul::kv::txn_ops::CheckNotExists{key_string});
 
-        if (lease) {
-            create_session_if_needed_();
-            txn.push_back(ppconsul::kv::txn_ops::Lock{key_string, value, session_id_});
+        if (!session_id.empty()) {
+            txn.push_back(ppconsul::kv::txn_ops::Lock{key_string, value, session_id});
         } else {
             txn.push_back(ppconsul::kv::txn_ops::Set{key_string, value});
         }
@@ -163,6 +418,101 @@ public:
         }
     }
 
+public:
+    ConsulClient(const std::string &address, Path prefix)
+        : Client(std::move(prefix))
+        , client_(address)
+        , kv_(client_, ppconsul::kw::consistency = CONSISTENCY)
+        , address_{address}
+        , lease_monitor_{std::make_shared<detail::LeaseMonitor>()}
+        , sessions_lock_{}
+        , sessions_{}
+        , expiring_sessions_{}
+    {}
+
+    int64_t create(const Key &key, const std::string &value, Lease lease = {}) override
+    {
+        return create_(key, value, lease ? session_for_(lease) : std::string{});
+    }
+
+    // the key is locked by a session that is never renewed, Consul erases it once the session expires
+    int64_t create(const Key &key, const std::string &value, std::chrono::seconds ttl) override
+    {
+        const auto session_id = expiring_sessions_.get(std::max(ttl, MIN_TTL), [this](std::chrono::seconds session_ttl) {
+            return ppconsul::sessions::Sessions(client_).create(
+                ppconsul::sessions::kw::lock_delay = std::chrono::seconds{0},
+                ppconsul::sessions::kw::behavior = ppconsul::sessions::InvalidationBehavior::Delete,
+                ppconsul::sessions::kw::ttl = session_ttl);
+        });
+        return create_(key, value, session_id);
+    }
+
+    // the counter is kept in a hidden key under the parent, user keys never contain "//";
+    // it is only accessed through transactions, an HTTP path with "//" would get cleaned
+    std::string create_sequential(const Key &parent, const std::string &value, Lease lease = {}) override
+    {
+        static constexpr size_t NAME_WIDTH = 20;
+
+        const std::string parent_string = as_path_string_(parent);
+        const std::string counter_string = parent_string + "/" + SEQUENCE_KEY_SUFFIX;
+        const std::string session_id = lease ? session_for_(lease) : std::string{};
+
+        try {
+            while (true) {
+                // a missing counter is not an error for GetAll, unlike for Get
+                std::vector<ppconsul::kv::KeyValue> read;
+                try {
+                    read = kv_.commit({
+                        ppconsul::kv::txn_ops::Get{parent_string},
+                        ppconsul::kv::txn_ops::GetAll{counter_string},
+                    });
+                } catch (const ppconsul::kv::TxnAborted &) {
+                    throw NoEntry{};
+                }
+
+                uint64_t counter = 0;
+                uint64_t counter_index = 0;
+                for (const auto &item : read)
+                    if (item.key == counter_string) {
+                        counter = std::stoull(item.value);
+                        counter_index = item.modifyIndex;
+                    }
+
+                // skip the names that are already taken by keys created otherwise
+                while (true) {
+                    const auto name = detail::sequential_name(++counter, NAME_WIDTH);
+                    const std::string key_string = parent_string + "/" + name;
+
+                    std::vector<ppconsul::kv::TxnOperation> txn{
+                        ppconsul::kv::txn_ops::Get{parent_string},
+                        ppconsul::kv::txn_ops::CompareSet{counter_string, counter_index, std::to_string(counter)},
+                        ppconsul::kv::txn_ops::CheckNotExists{key_string},
+                    };
+                    if (!session_id.empty())
+                        txn.push_back(ppconsul::kv::txn_ops::Lock{key_string, value, session_id});
+                    else
+                        txn.push_back(ppconsul::kv::txn_ops::Set{key_string, value});
+
+                    try {
+                        kv_.commit(txn);
+                        return name;
+                    } catch (const ppconsul::kv::TxnAborted &e) {
+                        const auto op_index = e.errors().front().opIndex;
+                        if (op_index == 0)
+                            throw NoEntry{};
+                        // the counter has moved on, read it again
+                        if (op_index == 1)
+                            break;
+                        if (op_index != 2)
+                            throw;
+                    }
+                }
+            }
+        } catch (const ppconsul::Error &e) {
+            rethrow_(e);
+        }
+    }
+
     ExistsResult exists(const Key &key, bool watch = false) override
     {
         const std::string key_string = as_path_string_(key);
@@ -180,35 +530,140 @@ public:
         }
     }
 
+    using Client::get_children;
+
     ChildrenResult get_children(const Key &key, bool watch = false) override
     {
         const std::string key_string = as_path_string_(key);
-        const std::string child_prefix = key_string + "/";
+        auto [children, max_modify_index] = list_children_(key_string);
+
+        std::unique_ptr<WatchHandle> watch_handle;
+        if (watch)
+            watch_handle = make_watch_handle_(key_string + "/", max_modify_index, true);
+
+        return {std::move(children), std::move(watch_handle)};
+    }
+
+    // lists the names of the direct children only, without the values of the whole subtree,
+    // and sorts on the client
+    std::vector<std::string> get_children(const Key &key, const ChildrenQuery &query) override
+    {
+        const std::string key_string = as_path_string_(key);
+        try {
+            if (!kv_.item(key_string).valid())
+                throw NoEntry{};
+
+            const auto nglobal_prefix = as_path_string_(Path{""}).size();
+            std::vector<std::string> children;
+            // a child with descendants is also listed as "key/child/"
+            for (const auto &child_key : kv_.subKeys(key_string + "/", '/'))
+                if (child_key.back() != '/')
+                    children.emplace_back(unwrap_key_(child_key, nglobal_prefix));
+
+            detail::apply_children_query(children, query);
+            return children;
+
+        } catch (const ppconsul::Error &e) {
+            rethrow_(e);
+        }
+    }
+
+    // Consul has no metadata-only read, and the children take a listing of their names
+    StatResult stat(const Key &key) override
+    {
+        const std::string key_string = as_path_string_(key);
+        try {
+            const auto item = kv_.item(key_string);
+            if (!item.valid())
+                throw NoEntry{};
+
+            const auto children_count = count_child_keys_(kv_.subKeys(key_string + "/", '/'));
+
+            return {
+                static_cast<int64_t>(item.modifyIndex),
+                static_cast<int64_t>(item.createIndex),
+                static_cast<int64_t>(item.modifyIndex),
+                item.value.size(),
+                children_count,
+                item.session
+            };
+
+        } catch (const ppconsul::Error &e) {
+            rethrow_(e);
+        }
+    }
+
+    // both are counted from the key names alone, Consul has no way to count on the server
+    size_t count_children(const Key &key) override
+    {
+        const std::string key_string = as_path_string_(key);
+        try {
+            if (!kv_.item(key_string).valid())
+                throw NoEntry{};
+
+            return count_child_keys_(kv_.subKeys(key_string + "/", '/'));
+
+        } catch (const ppconsul::Error &e) {
+            rethrow_(e);
+        }
+    }
+
+    size_t count_subtree(const Key &key) override
+    {
+        const std::string key_string = as_path_string_(key);
+        try {
+            if (!kv_.item(key_string).valid())
+                throw NoEntry{};
+
+            const auto keys = kv_.keys(key_string + "/");
+            return std::count_if(keys.begin(), keys.end(), [](const std::string &descendant_key) {
+                return !is_hidden_(descendant_key);
+            });
+
+        } catch (const ppconsul::Error &e) {
+            rethrow_(e);
+        }
+    }
+
+    ChildrenWatchResult watch_children(const Key &key) override
+    {
+        const std::string key_string = as_path_string_(key);
+        auto [children, max_modify_index] = list_children_(key_string);
+
+        auto watch_handle = std::make_unique<ConsulChildrenWatchHandle_>(
+            address_,
+            key_string,
+            as_path_string_(Path{""}).size(),
+            children,
+            max_modify_index);
+
+        return {std::move(children), std::move(watch_handle)};
+    }
+
+    std::unique_ptr<SubtreeWatchHandle> watch_subtree(const Key &key) override
+    {
+        const std::string key_string = as_path_string_(key);
+        const std::string subtree_prefix = key_string + "/";
         try {
             auto result = kv_.commit({
-                ppconsul::kv::txn_ops::GetAll{child_prefix},
                 ppconsul::kv::txn_ops::Get{key_string},
+                ppconsul::kv::txn_ops::GetAll{subtree_prefix},
             });
 
-            std::vector<std::string> children;
-            uint64_t max_modify_index = result.back().modifyIndex;
-            const auto nchild_prefix = child_prefix.size();
-            const auto nglobal_prefix = as_path_string_(Path{""}).size();
-            for (auto it = result.begin(), end = --result.end(); it != end; ++it) {
-                max_modify_index = std::max(max_modify_index, it->modifyIndex);
-                if (it->key.find('/', nchild_prefix) == std::string::npos) {
-                    if (nglobal_prefix)
-                        children.emplace_back(it->key.substr(nglobal_prefix));
-                    else
-                        children.emplace_back("/" + it->key);
-                }
+            std::map<std::string, uint64_t> versions;
+            uint64_t max_modify_index = 0;
+            for (const auto &item : result) {
+                max_modify_index = std::max(max_modify_index, item.modifyIndex);
+                if (item.key != key_string && !is_hidden_(item.key))
+                    versions.emplace(item.key, item.modifyIndex);
             }
 
-            std::unique_ptr<WatchHandle> watch_handle;
-            if (watch)
-                watch_handle = make_watch_handle_(child_prefix, max_modify_index, true);
-
-            return {std::move(children), std::move(watch_handle)};
+            return std::make_unique<ConsulSubtreeWatchHandle_>(
+                address_,
+                subtree_prefix,
+                as_path_string_(Path{""}).size(),
+                std::move(versions),
+                max_modify_index);
 
         } catch (const ppconsul::kv::TxnAborted &) {
             throw NoEntry{};
@@ -239,6 +694,8 @@ public:
         }
     }
 
+    using Client::get;
+
     GetResult get(const Key &key, bool watch = false) override
     {
         const std::string key_string = as_path_string_(key);
@@ -260,16 +717,72 @@ public:
         }
     }
 
+    // the index is checked in a transaction, the value is only read if it has changed
+    GetIfChangedResult get_if_changed(const Key &key, int64_t known_version) override
+    {
+        const std::string key_string = as_path_string_(key);
+        try {
+            if (known_version) {
+                try {
+                    kv_.commit({ppconsul::kv::txn_ops::CheckIndex{key_string, static_cast<uint64_t>(known_version)}});
+                    return {known_version, std::nullopt};
+                } catch (const ppconsul::kv::TxnAborted &) {}
+            }
+
+            auto item = kv_.item(key_string);
+            if (!item.valid())
+                throw NoEntry{};
+            return {static_cast<int64_t>(item.modifyIndex), std::move(item.value)};
+
+        } catch (const ppconsul::Error &e) {
+            rethrow_(e);
+        }
+    }
+
+    ValueWatchResult watch_value(const Key &key) override
+    {
+        const std::string key_string = as_path_string_(key);
+
+        try {
+            auto item = kv_.item(ppconsul::withHeaders, key_string);
+            if (!item.data().valid())
+                throw NoEntry{};
+            const uint64_t version = item.headers().index();
+
+            return {
+                static_cast<int64_t>(version),
+                item.data().value,
+                std::make_unique<ConsulValueWatchHandle_>(address_, key_string, version)
+            };
+
+        } catch (const ppconsul::Error &e) {
+            rethrow_(e);
+        }
+    }
+
     CasResult cas(const Key &key, const std::string &value, int64_t version = 0) override
     {
+        const std::string key_string = as_path_string_(key);
+
+        // an aborted Consul transaction returns no results, so the current state takes another read
+        const auto mismatch = [this, &key_string]() -> CasResult {
+            try {
+                auto item = kv_.item(key_string);
+                if (!item.valid())
+                    return {0};
+                return {0, static_cast<int64_t>(item.modifyIndex), std::move(item.value)};
+            } catch (const ppconsul::Error &e) {
+                rethrow_(e);
+            }
+        };
+
         if (!version)
             try {
                 return {create(key, value)};
             } catch (const EntryExists &) {
-                return {0};
+                return mismatch();
             }
 
-        const std::string key_string = as_path_string_(key);
         try {
             auto result = kv_.commit({
                 ppconsul::kv::txn_ops::Get{key_string},
@@ -281,7 +794,7 @@ public:
             const auto op_index = e.errors().front().opIndex;
             if (op_index == 0)
                 throw NoEntry{};
-            return {0};
+            return mismatch();
 
         } catch (const ppconsul::Error &e) {
             rethrow_(e);
@@ -320,121 +833,185 @@ public:
         }
     }
 
+    using Client::commit;
+
     TransactionResult commit(const Transaction& transaction) override
     {
         enum class ResultKind
         {
             CREATE,
             SET,
+            GET,
+            // a variable number of GetAll results followed by the Get of the parent itself
+            GET_CHILDREN,
             AUX,
         };
 
-        std::vector<ppconsul::kv::TxnOperation> txn;
-        std::vector<size_t> boundaries;
-        std::vector<ResultKind> result_kinds;
-
-        for (const auto &check : transaction.checks) {
-            if (check.version) {
-                txn.push_back(ppconsul::kv::txn_ops::CheckIndex{
-                    as_path_string_(check.key),
-                    static_cast<uint64_t>(check.version)
-                });
-            } else {
-                txn.push_back(ppconsul::kv::txn_ops::Get{
-                    as_path_string_(check.key)
-                });
+        while (true) {
+            std::vector<ppconsul::kv::TxnOperation> txn;
+            std::vector<size_t> boundaries;
+            std::vector<ResultKind> result_kinds;
+            // the parent key of each GET_CHILDREN op, in order
+            std::vector<std::string> children_parents;
+
+            for (size_t i = 0; i < transaction.checks.size(); ++i) {
+                const auto &check = transaction.checks[i];
+                if (check.kind == TxnCheck::Kind::ABSENT) {
+                    txn.push_back(ppconsul::kv::txn_ops::CheckNotExists{as_path_string_(check.key)});
+                } else if (check.kind != TxnCheck::Kind::VERSION) {
+                    // Consul cannot compare values, so the value is read and its index is pinned
+                    const std::string key_string = as_path_string_(check.key);
+                    try {
+                        const auto item = kv_.item(key_string);
+                        if (!item.valid() || !check.matches(item.value)) throw TxnFailed{i};
+                        txn.push_back(ppconsul::kv::txn_ops::CheckIndex{key_string, item.modifyIndex});
+                    } catch (const ppconsul::Error &e) {
+                        rethrow_(e);
+                    }
+                } else if (check.version) {
+                    txn.push_back(ppconsul::kv::txn_ops::CheckIndex{
+                        as_path_string_(check.key),
+                        static_cast<uint64_t>(check.version)
+                    });
+                } else {
+                    txn.push_back(ppconsul::kv::txn_ops::Get{
+                        as_path_string_(check.key)
+                    });
+                }
+                result_kinds.push_back(ResultKind::AUX);
+                boundaries.push_back(txn.size() - 1);
             }
-            result_kinds.push_back(ResultKind::AUX);
-            boundaries.push_back(txn.size() - 1);
-        }
 
-        for (const auto &op : transaction.ops) {
-            std::visit([this, &txn, &result_kinds](auto &&arg) {
-                using T = std::decay_t<decltype(arg)>;
-                const std::string key_string = as_path_string_(arg.key);
+            for (const auto &op : transaction.ops) {
+                std::visit([this, &txn, &result_kinds, &children_parents](auto &&arg) {
+                    using T = std::decay_t<decltype(arg)>;
+                    const std::string key_string = as_path_string_(arg.key);
 
-                if constexpr (std::is_same_v<T, TxnOpCreate>) {
+                    if constexpr (std::is_same_v<T, TxnOpCreate>) {
 
-                    const Path parent = arg.key.parent();
-                    if (!parent.root()) {
-                        txn.push_back(ppconsul::kv::txn_ops::Get{as_path_string_(parent)});
-                        result_kinds.push_back(ResultKind::AUX);
-                    }
+                        const Path parent = arg.key.parent();
+                        if (!parent.root()) {
+                            txn.push_back(ppconsul::kv::txn_ops::Get{as_path_string_(parent)});
+                            result_kinds.push_back(ResultKind::AUX);
+                        }
 
-                    txn.push_back(ppconsul::kv::txn_ops::CheckNotExists{key_string});
-                    // CheckNotExists does not produce any results
+                        txn.push_back(ppconsul::kv::txn_ops::CheckNotExists{key_string});
+                        // CheckNotExists does not produce any results
+
+                        if (arg.lease) {
+                            txn.push_back(ppconsul::kv::txn_ops::Lock{
+                                key_string,
+                                arg.value,
+                                session_for_(arg.lease),
+                            });
+                        } else {
+                            txn.push_back(ppconsul::kv::txn_ops::Set{key_string, arg.value});
+                        }
+                        result_kinds.push_back(ResultKind::CREATE);
+
+                    } else if constexpr (std::is_same_v<T, TxnOpSet>) {
+
+                        txn.push_back(ppconsul::kv::txn_ops::Get{key_string});
+                        result_kinds.push_back(ResultKind::AUX);
 
-                    if (arg.lease) {
-                        create_session_if_needed_();
-                        txn.push_back(ppconsul::kv::txn_ops::Lock{
-                            key_string,
-                            arg.value,
-                            session_id_,
-                        });
-                    } else {
                         txn.push_back(ppconsul::kv::txn_ops::Set{key_string, arg.value});
-                    }
-                    result_kinds.push_back(ResultKind::CREATE);
+                        result_kinds.push_back(ResultKind::SET);
 
-                } else if constexpr (std::is_same_v<T, TxnOpSet>) {
+                    } else if constexpr (std::is_same_v<T, TxnOpErase>) {
 
-                    txn.push_back(ppconsul::kv::txn_ops::Get{key_string});
-                    result_kinds.push_back(ResultKind::AUX);
+                        txn.push_back(ppconsul::kv::txn_ops::Get{key_string});
+                        result_kinds.push_back(ResultKind::AUX);
 
-                    txn.push_back(ppconsul::kv::txn_ops::Set{key_string, arg.value});
-                    result_kinds.push_back(ResultKind::SET);
+                        txn.push_back(ppconsul::kv::txn_ops::Erase{key_string});
+                        // Erase does not produce any results
 
-                } else if constexpr (std::is_same_v<T, TxnOpErase>) {
+                        txn.push_back(ppconsul::kv::txn_ops::EraseAll{key_string + "/"});
+                        // EraseAll does not produce any results
 
-                    txn.push_back(ppconsul::kv::txn_ops::Get{key_string});
-                    result_kinds.push_back(ResultKind::AUX);
+                    } else if constexpr (std::is_same_v<T, TxnOpGet>) {
 
-                    txn.push_back(ppconsul::kv::txn_ops::Erase{key_string});
-                    // Erase does not produce any results
+                        txn.push_back(ppconsul::kv::txn_ops::Get{key_string});
+                        result_kinds.push_back(ResultKind::GET);
 
-                    txn.push_back(ppconsul::kv::txn_ops::EraseAll{key_string + "/"});
-                    // EraseAll does not produce any results
+                    } else if constexpr (std::is_same_v<T, TxnOpGetChildren>) {
 
-                } else static_assert(detail::always_false<T>::value, "non-exhaustive visitor");
-            }, op);
+                        txn.push_back(ppconsul::kv::txn_ops::GetAll{key_string + "/"});
+                        // fails the transaction if the parent does not exist
+                        txn.push_back(ppconsul::kv::txn_ops::Get{key_string});
+                        result_kinds.push_back(ResultKind::GET_CHILDREN);
+                        children_parents.push_back(key_string);
 
-            boundaries.push_back(txn.size() - 1);
-        }
+                    } else static_assert(detail::always_false<T>::value, "non-exhaustive visitor");
+                }, op);
 
-        try {
-            auto results = kv_.commit(txn);
-            std::vector<TxnOpResult> answer;
-            for (size_t i = 0; i < results.size(); ++i) {
-                switch (result_kinds[i]) {
-                case ResultKind::CREATE:
-                    answer.push_back(TxnOpResult{
-                        TxnOpResult::Kind::CREATE,
-                        static_cast<int64_t>(results[i].modifyIndex)
-                    });
-                    break;
-                case ResultKind::SET:
-                    answer.push_back(TxnOpResult{
-                        TxnOpResult::Kind::SET,
-                        static_cast<int64_t>(results[i].modifyIndex)
-                    });
-                    break;
-                case ResultKind::AUX:
-                    break;
-                }
+                boundaries.push_back(txn.size() - 1);
             }
-            return answer;
 
-        } catch (const ppconsul::kv::TxnAborted &e) {
-            const auto op_index = e.errors().front().opIndex;
-            const size_t user_op_index =
-                std::lower_bound(boundaries.begin(), boundaries.end(), op_index)
-                - boundaries.begin();
-            throw TxnFailed{user_op_index};
+            try {
+                auto results = kv_.commit(txn);
+                std::vector<TxnOpResult> answer;
+                const auto nglobal_prefix = as_path_string_(Path{""}).size();
+                auto parent_it = children_parents.begin();
+                // results[j] is the first result of the op of kind result_kinds[i]
+                for (size_t i = 0, j = 0; i < result_kinds.size(); ++i, ++j) {
+                    switch (result_kinds[i]) {
+                    case ResultKind::CREATE:
+                        answer.push_back(TxnOpResult{
+                            TxnOpResult::Kind::CREATE,
+                            static_cast<int64_t>(results[j].modifyIndex)
+                        });
+                        break;
+                    case ResultKind::SET:
+                        answer.push_back(TxnOpResult{
+                            TxnOpResult::Kind::SET,
+                            static_cast<int64_t>(results[j].modifyIndex)
+                        });
+                        break;
+                    case ResultKind::GET:
+                        answer.push_back(TxnOpResult{
+                            TxnOpResult::Kind::GET,
+                            static_cast<int64_t>(results[j].modifyIndex),
+                            std::move(results[j].value)
+                        });
+                        break;
+                    case ResultKind::GET_CHILDREN: {
+                        const std::string &parent = *parent_it++;
+                        const auto nchild_prefix = parent.size() + 1;
+                        std::vector<std::string> children;
+                        for (; results[j].key != parent; ++j)
+                            if (results[j].key.find('/', nchild_prefix) == std::string::npos)
+                                children.emplace_back(unwrap_key_(results[j].key, nglobal_prefix));
+                        answer.push_back(TxnOpResult{TxnOpResult::Kind::GET_CHILDREN, 0, {}, std::move(children)});
+                        break;
+                    }
+                    case ResultKind::AUX:
+                        break;
+                    }
+                }
+                return answer;
+
+            } catch (const ppconsul::kv::TxnAborted &e) {
+                const auto op_index = e.errors().front().opIndex;
+                const size_t user_op_index =
+                    std::lower_bound(boundaries.begin(), boundaries.end(), op_index)
+                    - boundaries.begin();
+                // a value read for a check has changed since, repeat
+                if (user_op_index < transaction.checks.size()
+                        && transaction.checks[user_op_index].kind != TxnCheck::Kind::VERSION
+                        && transaction.checks[user_op_index].kind != TxnCheck::Kind::ABSENT)
+                    continue;
+                throw TxnFailed{user_op_index};
 
-        } catch (const ppconsul::Error &e) {
-            rethrow_(e);
+            } catch (const ppconsul::Error &e) {
+                rethrow_(e);
+            }
         }
     }
+
+    void set_lease_warning_handler(std::chrono::milliseconds min_margin, LeaseWarningHandler handler) override
+    {
+        lease_monitor_->set_handler(min_margin, std::move(handler));
+    }
 };
 
 } // namespace liboffkv
@@ -8,10 +8,17 @@
 
 #include <future>
 #include <mutex>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <vector>
+#include <algorithm>
 
 
 #include "key.hpp"
 #include "ping_sender.hpp"
+#include "util.hpp"
 
 
 namespace liboffkv {
@@ -31,7 +38,7 @@ void ensure_succeeded_(grpc::Status status)
 } // namespace detail
 
 
-class ETCDWatchCreator {
+class ETCDWatchCreator : public std::enable_shared_from_this<ETCDWatchCreator> {
 public:
     using WatchCreateRequest = etcdserverpb::WatchCreateRequest;
     using WatchResponse = etcdserverpb::WatchResponse;
@@ -43,6 +50,26 @@ public:
         std::function<void(const ServiceError&)> process_failure;
     };
 
+    // cancels the watch (both the handler and the server-side watch) on destruction
+    class Subscription {
+    private:
+        std::weak_ptr<ETCDWatchCreator> creator_;
+        uint64_t id_;
+
+    public:
+        Subscription(std::weak_ptr<ETCDWatchCreator> creator, uint64_t id)
+            : creator_(std::move(creator)), id_(id)
+        {}
+
+        Subscription(const Subscription&) = delete;
+        Subscription& operator=(const Subscription&) = delete;
+
+        ~Subscription()
+        {
+            if (auto creator = creator_.lock()) creator->cancel_watch(id_);
+        }
+    };
+
 private:
     static inline void* const tag_init_stream = reinterpret_cast<void*>(1);
     static inline void* const tag_write_finished = reinterpret_cast<void*>(2);
@@ -52,23 +79,37 @@ private:
     using WatchCancelRequest = etcdserverpb::WatchCancelRequest;
     using WatchEndpoint = etcdserverpb::Watch;
 
+    struct Watch_ {
+        uint64_t subscription_id;
+        WatchEventHandler handler;
+        bool cancelled = false;
+    };
+
     std::mutex lock_;
 
     std::unique_ptr<WatchEndpoint::Stub> watch_stub_;
     grpc::ClientContext watch_context_;
     std::shared_ptr<grpc::ClientAsyncReaderWriter<WatchRequest, WatchResponse>> watch_stream_;
+    bool watch_stream_ready_ = false;
     std::unique_ptr<WatchResponse> pending_watch_response_;
-    std::map<int64_t, WatchEventHandler> watch_handlers_;
+
+    // etcd watch id -> watch
+    std::map<int64_t, Watch_> watch_handlers_;
+    // subscription id -> etcd watch id
+    std::map<uint64_t, int64_t> watch_ids_;
+    uint64_t last_subscription_id_ = 0;
 
     grpc::CompletionQueue cq_;
 
     bool watch_resolution_thread_running_ = false;
     std::thread watch_resolution_thread_;
 
-    std::unique_ptr<std::promise<void>> current_watch_write_;
-    std::unique_ptr<WatchEventHandler> pending_watch_handler_;
+    // only one write may be in flight, it is the front one
+    std::deque<std::pair<WatchRequest, std::promise<void>>> write_queue_;
+
+    // "created" responses do not refer to the request, so watches are created one by one
+    std::unique_ptr<Watch_> pending_watch_handler_;
 
-    std::condition_variable write_wait_cv_;
     std::condition_variable create_watch_wait_cv_;
 
 
@@ -77,33 +118,30 @@ private:
         std::lock_guard lock(lock_);
 
         watch_stream_ = nullptr;
+        watch_stream_ready_ = false;
         pending_watch_response_ = nullptr;
 
-        for (const auto& [_, watch_handler] : watch_handlers_) (void)_, watch_handler.process_failure(exc);
+        for (const auto& [_, watch] : watch_handlers_) (void)_, watch.handler.process_failure(exc);
 
         watch_handlers_.clear();
+        watch_ids_.clear();
 
-        if (current_watch_write_) {
-            current_watch_write_->set_exception(std::make_exception_ptr(exc));
-            current_watch_write_ = nullptr;
-        }
+        for (auto& [_, write] : write_queue_) (void)_, write.set_exception(std::make_exception_ptr(exc));
+        write_queue_.clear();
 
         if (pending_watch_handler_) {
-            pending_watch_handler_->process_failure(exc);
+            pending_watch_handler_->handler.process_failure(exc);
             pending_watch_handler_ = nullptr;
         }
 
-        write_wait_cv_.notify_all();
         create_watch_wait_cv_.notify_all();
     }
 
     void setup_watch_infrastructure_m()
     {
         if (watch_stream_) return;
-        if (current_watch_write_) throw std::logic_error("Inconsistent internal state");
 
-        // just to slow down next write until stream init
-        current_watch_write_ = std::make_unique<std::promise<void>>();
+        // writes are queued until stream init
         watch_stream_ = watch_stub_->AsyncWatch(&watch_context_, &cq_, tag_init_stream);
 
         if (!watch_resolution_thread_running_) {
@@ -112,11 +150,10 @@ private:
         }
     }
 
-    void resolve_write_m()
+    void start_next_write_m()
     {
-        current_watch_write_->set_value();
-        current_watch_write_ = nullptr;
-        write_wait_cv_.notify_one();
+        if (watch_stream_ready_ && !write_queue_.empty())
+            watch_stream_->Write(write_queue_.front().first, tag_write_finished);
     }
 
     void watch_resolution_loop_()
@@ -133,28 +170,36 @@ private:
 
             if (tag == tag_init_stream) {
                 // stream initialized
-                resolve_write_m();
+                watch_stream_ready_ = true;
+                start_next_write_m();
                 request_read_next_watch_response_m();
                 continue;
             }
 
             if (tag == tag_write_finished) {
                 // resolve write and continue
-                resolve_write_m();
+                write_queue_.front().second.set_value();
+                write_queue_.pop_front();
+                start_next_write_m();
                 continue;
             }
 
             if (tag == tag_response_got) {
                 // resolve response
                 if (auto* response = pending_watch_response_.release()) {
-                    if (response->created()) {
-                        watch_handlers_[response->watch_id()] = *pending_watch_handler_;
+                    if (response->created() && pending_watch_handler_) {
+                        if (pending_watch_handler_->cancelled) {
+                            cancel_watch_m(response->watch_id());
+                        } else {
+                            watch_ids_[pending_watch_handler_->subscription_id] = response->watch_id();
+                            watch_handlers_[response->watch_id()] = std::move(*pending_watch_handler_);
+                        }
                         pending_watch_handler_ = nullptr;
                         create_watch_wait_cv_.notify_one();
                     }
 
                     if (!(response->created() || response->canceled()) && process_watch_response_m(*response)) {
-                        cancel_watch_m(response->watch_id(), lock);
+                        cancel_watch_m(response->watch_id());
                     }
 
                     delete response;
@@ -165,23 +210,24 @@ private:
         }
     }
 
-    void cancel_watch_m(int64_t watch_id, std::unique_lock<std::mutex>& lock)
+    void cancel_watch_m(int64_t watch_id)
     {
         auto* cancel_req = new WatchCancelRequest();
         cancel_req->set_watch_id(watch_id);
         WatchRequest req;
         req.set_allocated_cancel_request(cancel_req);
-        write_to_watch_stream_m(req, lock);
+        write_to_watch_stream_m(req);
     }
 
     bool process_watch_response_m(const WatchResponse& response)
     {
-        if (!watch_handlers_.count(response.watch_id())) return true;
-        WatchEventHandler& handler = watch_handlers_[response.watch_id()];
+        auto it = watch_handlers_.find(response.watch_id());
+        if (it == watch_handlers_.end()) return true;
 
         for (const Event& event : response.events()) {
-            if (handler.process_event(event)) {
-                watch_handlers_.erase(response.watch_id());
+            if (it->second.handler.process_event(event)) {
+                watch_ids_.erase(it->second.subscription_id);
+                watch_handlers_.erase(it);
                 return true;
             }
         }
@@ -196,16 +242,15 @@ private:
         watch_stream_->Read(pending_watch_response_.get(), tag_response_got);
     }
 
-    std::future<void> write_to_watch_stream_m(const WatchRequest& request, std::unique_lock<std::mutex>& lock)
+    std::future<void> write_to_watch_stream_m(const WatchRequest& request)
     {
         setup_watch_infrastructure_m();
 
-        while (current_watch_write_) write_wait_cv_.wait(lock);
-
-        current_watch_write_ = std::make_unique<std::promise<void>>();
-        watch_stream_->Write(request, tag_write_finished);
+        write_queue_.emplace_back(request, std::promise<void>());
+        auto future = write_queue_.back().second.get_future();
+        if (write_queue_.size() == 1) start_next_write_m();
 
-        return current_watch_write_->get_future();
+        return future;
     }
 
 
@@ -214,21 +259,43 @@ public:
         : watch_stub_(WatchEndpoint::NewStub(channel))
     {}
 
-    void create_watch(const WatchCreateRequest& create_req, const WatchEventHandler& handler)
+    std::unique_ptr<Subscription> create_watch(const WatchCreateRequest& create_req, const WatchEventHandler& handler)
     {
         WatchRequest request;
         request.set_allocated_create_request(new WatchCreateRequest(create_req));
 
+        uint64_t subscription_id;
         std::future<void> watch_write_future;
         {
             std::unique_lock lock(lock_);
             while (pending_watch_handler_) create_watch_wait_cv_.wait(lock);
 
-            pending_watch_handler_ = std::make_unique<WatchEventHandler>(handler);
-            watch_write_future = write_to_watch_stream_m(request, lock);
+            subscription_id = ++last_subscription_id_;
+            pending_watch_handler_ = std::make_unique<Watch_>(Watch_{subscription_id, handler});
+            watch_write_future = write_to_watch_stream_m(request);
         }
 
         watch_write_future.get();
+        return std::make_unique<Subscription>(weak_from_this(), subscription_id);
+    }
+
+    void cancel_watch(uint64_t subscription_id)
+    {
+        std::lock_guard lock(lock_);
+
+        if (pending_watch_handler_ && pending_watch_handler_->subscription_id == subscription_id) {
+            // will be cancelled as soon as created
+            pending_watch_handler_->cancelled = true;
+            return;
+        }
+
+        // the watch has already fired or failed
+        auto it = watch_ids_.find(subscription_id);
+        if (it == watch_ids_.end()) return;
+
+        watch_handlers_.erase(it->second);
+        cancel_watch_m(it->second);
+        watch_ids_.erase(it);
     }
 
     ~ETCDWatchCreator()
@@ -247,62 +314,302 @@ public:
 
 class LeaseIssuer {
 private:
-    static inline const size_t LEASE_TIMEOUT = 10; // seconds
-
     using LeaseEndpoint = etcdserverpb::Lease;
+    using KeepAliveRequest = etcdserverpb::LeaseKeepAliveRequest;
+    using KeepAliveResponse = etcdserverpb::LeaseKeepAliveResponse;
+    using Clock = std::chrono::steady_clock;
+
+    // Renews the lease over an asynchronous stream: keep-alives are sent on schedule
+    // even while a previous response is late, and every response moves the deadline.
+    // A broken stream is reopened after a backoff; the lease is only lost once it expires.
+    class KeepAlive_ {
+    private:
+        using Stream = grpc::ClientAsyncReaderWriter<KeepAliveRequest, KeepAliveResponse>;
 
-    int64_t lease_id_{0};
-    std::unique_ptr<LeaseEndpoint::Stub> lease_stub_;
-    detail::PingSender ping_sender_;
+        static constexpr auto MIN_PING_INTERVAL = std::chrono::milliseconds(100);
 
+        enum class Op_ { INIT, WRITE, READ };
 
-    void setup_lease_renewal_(int64_t lease_id, std::chrono::seconds ttl)
-    {
-        auto context_ptr = std::make_shared<grpc::ClientContext>();
-        auto stream = lease_stub_->LeaseKeepAlive(context_ptr.get());
+        struct Stream_;
+
+        // completion queue tag, tells the stream the event belongs to
+        struct Tag_ {
+            Stream_* stream;
+            Op_ op;
+        };
+
+        struct Stream_ {
+            grpc::ClientContext context;
+            std::unique_ptr<Stream> rw;
+            Tag_ init{this, Op_::INIT};
+            Tag_ write{this, Op_::WRITE};
+            Tag_ read{this, Op_::READ};
+            KeepAliveResponse response;
+            // operations started and not completed yet
+            size_t pending = 0;
+        };
+
+        LeaseEndpoint::Stub& stub_;
+        std::shared_ptr<detail::LeaseMonitor> monitor_;
+
+        std::mutex lock_;
+        bool stopping_ = false;
+        std::atomic<bool> lost_{false};
+
+        grpc::CompletionQueue cq_;
+        // empty while waiting to be reopened
+        std::unique_ptr<Stream_> stream_;
+        // cancelled streams whose operations are still to be completed
+        std::vector<std::unique_ptr<Stream_>> broken_;
+        detail::Backoff reopen_backoff_{std::chrono::milliseconds(100), std::chrono::seconds(2)};
+        Clock::time_point reopen_at_;
+
+        KeepAliveRequest request_;
+
+        bool stream_ready_ = false;
+        bool write_in_flight_ = false;
+        // send times of the keep-alives not yet acknowledged
+        std::deque<Clock::time_point> unacked_;
+        std::chrono::seconds ttl_;
+        Clock::time_point next_ping_;
+        Clock::time_point expires_at_;
+
+        std::thread thread_;
+
+
+        static std::chrono::milliseconds as_millis_(Clock::duration duration)
+        {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(duration);
+        }
+
+        // three keep-alives per TTL; the division is done in clock ticks,
+        // as whole seconds would make it zero for TTLs under 3s
+        static Clock::duration ping_interval_(std::chrono::seconds ttl)
+        {
+            return std::max<Clock::duration>(std::chrono::duration_cast<Clock::duration>(ttl) / 3, MIN_PING_INTERVAL);
+        }
+
+        void open_m()
+        {
+            stream_ = std::make_unique<Stream_>();
+            stream_->rw = stub_.AsyncLeaseKeepAlive(&stream_->context, &cq_, &stream_->init);
+            stream_->pending = 1;
+        }
+
+        // the keep-alives sent over the broken stream are never acknowledged
+        void break_m(Clock::time_point now)
+        {
+            stream_->context.TryCancel();
+            if (stream_->pending) broken_.push_back(std::move(stream_));
+            else stream_.reset();
+            stream_ready_ = false;
+            write_in_flight_ = false;
+            unacked_.clear();
+            reopen_at_ = now + reopen_backoff_.next();
+        }
+
+        void lose_m()
+        {
+            if (lost_) return;
+            lost_ = true;
+            if (stream_) stream_->context.TryCancel();
+            monitor_->report({std::chrono::milliseconds::zero(), std::chrono::milliseconds::zero(), true});
+        }
+
+        void read_m()
+        {
+            ++stream_->pending;
+            stream_->rw->Read(&stream_->response, &stream_->read);
+        }
+
+        void ping_m(Clock::time_point now)
+        {
+            write_in_flight_ = true;
+            unacked_.push_back(now);
+            next_ping_ = now + ping_interval_(ttl_);
+            ++stream_->pending;
+            stream_->rw->Write(request_, &stream_->write);
+        }
+
+        void process_event_m(Op_ op, Clock::time_point now)
+        {
+            if (op == Op_::INIT) {
+                stream_ready_ = true;
+                read_m();
+                if (now >= next_ping_) ping_m(now);
+            } else if (op == Op_::WRITE) {
+                write_in_flight_ = false;
+            } else if (op == Op_::READ) {
+                const auto& response = stream_->response;
+                if (response.ttl() <= 0) return lose_m();
+
+                // the lease was prolonged no later than the request was sent
+                auto sent_at = unacked_.empty() ? now : unacked_.front();
+                if (!unacked_.empty()) unacked_.pop_front();
+
+                ttl_ = std::chrono::seconds(response.ttl());
+                expires_at_ = sent_at + ttl_;
+                reopen_backoff_.reset();
+                monitor_->report({as_millis_(now - sent_at), as_millis_(expires_at_ - now), false});
+
+                read_m();
+            }
+        }
+
+        void process_timeout_m(Clock::time_point now)
+        {
+            if (now >= expires_at_) return lose_m();
+
+            if (!stream_ && now >= reopen_at_) open_m();
+
+            // renewal is late, warn while there is still time
+            if (!unacked_.empty())
+                monitor_->report({as_millis_(now - unacked_.front()), as_millis_(expires_at_ - now), false});
+            else if (!stream_ready_)
+                monitor_->report({as_millis_(now - (expires_at_ - ttl_)), as_millis_(expires_at_ - now), false});
+
+            if (stream_ready_ && !write_in_flight_ && now >= next_ping_) ping_m(now);
+        }
+
+        void loop_()
+        {
+            void* tag;
+            bool succeeded;
+            while (true) {
+                auto now = Clock::now();
+                // wake up at least every second to check the margin
+                auto deadline = now + std::chrono::seconds(1);
+                {
+                    std::lock_guard lock(lock_);
+                    if (!lost_) deadline = std::min(deadline, expires_at_);
+                    if (!lost_ && !stream_) deadline = std::min(deadline, reopen_at_);
+                    if (!lost_ && stream_ready_ && !write_in_flight_) deadline = std::min(deadline, next_ping_);
+                }
+
+                // grpc only takes system_clock deadlines
+                auto status = cq_.AsyncNext(&tag, &succeeded, std::chrono::system_clock::now() + (deadline - now));
+                if (status == grpc::CompletionQueue::SHUTDOWN) break;
 
-        etcdserverpb::LeaseKeepAliveRequest req;
-        req.set_id(lease_id);
+                std::lock_guard lock(lock_);
+                if (stopping_ || lost_) continue;
 
-        ping_sender_ = detail::PingSender(
-            (ttl + std::chrono::seconds(1)) / 2,
-            [req = std::move(req), context_ptr, stream = std::move(stream)]() {
-                if (!stream->Write(req)) {
-                    return std::chrono::seconds::zero();
+                now = Clock::now();
+                if (status == grpc::CompletionQueue::TIMEOUT) {
+                    process_timeout_m(now);
+                    continue;
+                }
+
+                auto event = static_cast<Tag_*>(tag);
+                --event->stream->pending;
+                if (event->stream != stream_.get()) {
+                    // the last event of a broken stream, it can be released
+                    if (!event->stream->pending)
+                        broken_.erase(std::find_if(broken_.begin(), broken_.end(), [event](const auto& stream) {
+                            return stream.get() == event->stream;
+                        }));
+                } else if (!succeeded) {
+                    break_m(now);
+                } else {
+                    process_event_m(event->op, now);
                 }
-                etcdserverpb::LeaseKeepAliveResponse response;
-                stream->Read(&response);
-                return std::chrono::seconds((response.ttl() + 1) / 2);
             }
-        );
-    }
+        }
+
+    public:
+        KeepAlive_(LeaseEndpoint::Stub& stub, int64_t lease_id, std::chrono::seconds ttl,
+                   Clock::time_point granted_at, std::shared_ptr<detail::LeaseMonitor> monitor)
+            : stub_(stub),
+              monitor_(std::move(monitor)),
+              ttl_(ttl),
+              next_ping_(granted_at + ping_interval_(ttl)),
+              expires_at_(granted_at + ttl)
+        {
+            request_.set_id(lease_id);
+            open_m();
+            thread_ = std::thread([this] { this->loop_(); });
+        }
+
+        KeepAlive_(const KeepAlive_&) = delete;
+        KeepAlive_& operator=(const KeepAlive_&) = delete;
+
+        bool lost() const { return lost_; }
+
+        ~KeepAlive_()
+        {
+            {
+                std::lock_guard lock(lock_);
+                stopping_ = true;
+                if (stream_) stream_->context.TryCancel();
+                cq_.Shutdown();
+            }
+            thread_.join();
+        }
+    };
+
+    struct Lease_ {
+        int64_t id;
+        std::unique_ptr<KeepAlive_> keep_alive;
+    };
+
+    std::unique_ptr<LeaseEndpoint::Stub> lease_stub_;
+    std::shared_ptr<detail::LeaseMonitor> monitor_;
+
+    std::mutex lock_;
+    // one lease per TTL
+    std::map<std::chrono::seconds, Lease_> leases_;
+    // leases that are never renewed
+    detail::ExpiryPool<int64_t> expiring_leases_;
+
 
-    int64_t create_lease_()
+    etcdserverpb::LeaseGrantResponse grant_(std::chrono::seconds ttl)
     {
         etcdserverpb::LeaseGrantRequest req;
         req.set_id(0);
-        req.set_ttl(LEASE_TIMEOUT);
+        req.set_ttl(ttl.count());
 
         grpc::ClientContext context;
         etcdserverpb::LeaseGrantResponse response;
         grpc::Status status = lease_stub_->LeaseGrant(&context, req, &response);
 
         detail::ensure_succeeded_(status);
+        return response;
+    }
+
+    Lease_ create_lease_(std::chrono::seconds ttl)
+    {
+        auto granted_at = Clock::now();
+        auto response = grant_(ttl);
 
-        setup_lease_renewal_(response.id(), std::chrono::seconds(response.ttl()));
-        return response.id();
+        return {
+            response.id(),
+            std::make_unique<KeepAlive_>(
+                *lease_stub_, response.id(), std::chrono::seconds(response.ttl()), granted_at, monitor_)
+        };
     }
 
 
 public:
-    LeaseIssuer(const std::shared_ptr<grpc::Channel>& channel)
-        : lease_stub_(LeaseEndpoint::NewStub(channel))
+    LeaseIssuer(const std::shared_ptr<grpc::Channel>& channel, std::shared_ptr<detail::LeaseMonitor> monitor)
+        : lease_stub_(LeaseEndpoint::NewStub(channel)),
+          monitor_(std::move(monitor))
     {}
 
-    int64_t get_lease()
+    int64_t get_lease(const Lease& lease)
+    {
+        if (!lease) return 0;
+
+        std::lock_guard lock(lock_);
+        auto it = leases_.find(lease.ttl());
+        // a lost lease is replaced, the keys attached to it are gone anyway
+        if (it == leases_.end() || it->second.keep_alive->lost())
+            it = leases_.insert_or_assign(lease.ttl(), create_lease_(lease.ttl())).first;
+        return it->second.id;
+    }
+
+    // a lease that expires in ttl (or slightly later) and is shared by keys expiring at about the same time
+    int64_t get_expiring_lease(std::chrono::seconds ttl)
     {
-        if (!lease_id_) lease_id_ = create_lease_();
-        return lease_id_;
+        return expiring_leases_.get(ttl, [this](std::chrono::seconds lease_ttl) { return grant_(lease_ttl).id(); });
     }
 };
 
@@ -381,6 +688,20 @@ public:
         return *this;
     }
 
+    ETCDTransactionBuilder& add_value_compare(const std::string& key, const std::string& value)
+    {
+        auto cmp = make_compare_(key, Compare::VALUE, Compare::EQUAL);
+        cmp->set_value(value);
+        return *this;
+    }
+
+    ETCDTransactionBuilder& add_mod_revision_compare(const std::string& key, int64_t revision)
+    {
+        auto cmp = make_compare_(key, Compare::MOD, Compare::EQUAL);
+        cmp->set_mod_revision(revision);
+        return *this;
+    }
+
     ETCDTransactionBuilder& add_lease_compare(const std::string& key, int64_t lease)
     {
         auto cmp = make_compare_(key, Compare::LEASE, Compare::EQUAL);
@@ -438,6 +759,30 @@ public:
         return *this;
     }
 
+    // keys only, sorted by key on the server
+    ETCDTransactionBuilder& add_sorted_range_request(const std::pair<std::string, std::string>& range,
+                                                     bool descend, int64_t limit)
+    {
+        add_range_request(range, true, limit);
+
+        auto& ops = status_ == TBStatus::SUCCESS ? *txn_.mutable_success() : *txn_.mutable_failure();
+        auto request = ops.rbegin()->mutable_request_range();
+        request->set_sort_target(RangeRequest::KEY);
+        request->set_sort_order(descend ? RangeRequest::DESCEND : RangeRequest::ASCEND);
+
+        return *this;
+    }
+
+    ETCDTransactionBuilder& add_count_request(const std::pair<std::string, std::string>& range)
+    {
+        add_range_request(range, true, 0);
+
+        auto& ops = status_ == TBStatus::SUCCESS ? *txn_.mutable_success() : *txn_.mutable_failure();
+        ops.rbegin()->mutable_request_range()->set_count_only(true);
+
+        return *this;
+    }
+
     ETCDTransactionBuilder& add_delete_range_request(
         const std::variant<std::string, std::pair<std::string, std::string>>& range)
     {
@@ -459,6 +804,9 @@ public:
 
 class ETCDClient : public Client {
 private:
+    // every watch stream runs a thread of its own
+    static constexpr size_t MAX_WATCH_STREAMS = 64;
+
     using KV = etcdserverpb::KV;
 
     using RangeRequest = etcdserverpb::RangeRequest;
@@ -471,7 +819,10 @@ private:
     std::shared_ptr<grpc::Channel> channel_;
     std::unique_ptr<KV::Stub> stub_;
 
-    ETCDWatchCreator watch_creator_;
+    // each watch creator owns a stream, a completion queue and a resolution thread;
+    // watches are spread over them by key
+    std::vector<std::shared_ptr<ETCDWatchCreator>> watch_creators_;
+    std::shared_ptr<detail::LeaseMonitor> lease_monitor_;
     LeaseIssuer lease_issuer_;
 
 
@@ -521,170 +872,823 @@ private:
         );
     }
 
-    // removes prefix and auxiliary \0
-    std::string unwrap_key_(const std::string& full_path) const
+    // the counters of create_sequential start with '\1', which no key can contain,
+    // so they lie outside every key range: "\1/prefix/a/b/" counts the children of "/a/b"
+    std::string sequence_counter_(const Key& parent) const
     {
-        size_t pos = full_path.rfind('/');
-        return full_path.substr(prefix_.size(), pos + 1 - prefix_.size()) + full_path.substr(pos + 2);
+        return '\1' + static_cast<std::string>(prefix_ / parent) + '/';
     }
 
-    TxnResponse commit_(grpc::ClientContext& context, const TxnRequest& txn)
+    // the counters of the key and all its descendants
+    auto make_sequence_range_(const Key& root) const
     {
-        TxnResponse response;
-
-        auto status = stub_->Txn(&context, txn, &response);
-        detail::ensure_succeeded_(status);
-
-        return response;
+        auto counter = sequence_counter_(root);
+        auto end = counter;
+        end.back() = static_cast<char>('/' + 1);
+        return std::make_pair(std::move(counter), std::move(end));
     }
 
-
-    class ETCDWatchHandle_ : public WatchHandle {
-    private:
-        std::shared_future<void> future_;
-
-    public:
-        ETCDWatchHandle_(std::shared_future<void>&& future)
-            : future_(std::move(future))
-        {}
-
-        void wait() override { future_.get(); }
-    };
-
-
-    template <typename EventChecker>
-    std::unique_ptr<WatchHandle> make_watch_handle_(
-            const ETCDWatchCreator::WatchCreateRequest& request,
-            EventChecker&& stop_waiting_condition
-        )
+    // removes prefix and auxiliary \0
+    template<class String = std::string>
+    String unwrap_key_(const std::string& full_path, typename String::allocator_type allocator = {}) const
     {
-        auto promise = std::make_shared<std::promise<void>>();
-        watch_creator_.create_watch(
-            request,
-            {
-                [promise, foo = std::forward<EventChecker>(stop_waiting_condition)]
-                    (const ETCDWatchCreator::Event& event) mutable
-                {
-                    if (foo(event)) {
-                        promise->set_value();
-                        return true;
-                    }
-                    return false;
-                },
-                [promise](const ServiceError& exc)
-                {
-                    promise->set_exception(std::make_exception_ptr(exc));
-                }
-            });
-        return std::make_unique<ETCDWatchHandle_>(promise->get_future().share());
+        size_t pos = full_path.rfind('/');
+        String result(allocator);
+        result.reserve(full_path.size() - prefix_.size() - 1);
+        result.append(full_path.data() + prefix_.size(), pos + 1 - prefix_.size())
+              .append(full_path.data() + pos + 2, full_path.size() - pos - 2);
+        return result;
     }
 
-
-public:
-    ETCDClient(const std::string& address, Path prefix)
-        : Client(std::move(prefix)),
-          channel_(grpc::CreateChannel(address, grpc::InsecureChannelCredentials())),
-          stub_(KV::NewStub(channel_)),
-          watch_creator_(channel_),
-          lease_issuer_(channel_)
-    {}
-
-
-    int64_t create(const Key& key, const std::string& value, bool lease = false) override
+    ETCDWatchCreator& watch_creator_for_(const std::string& key)
     {
-        grpc::ClientContext context;
-        ETCDTransactionBuilder bldr;
-
-        auto path = as_path_string_(key);
-
-        if (auto parent = key.parent(); !parent.root()) bldr.add_check_exists(as_path_string_(parent));
-
-        bldr.add_check_not_exists(path)
-            // on success put value
-            .on_success().add_put_request(path, value, lease ? lease_issuer_.get_lease() : 0)
-            // on failure perform get request to determine a kind of error
-            .on_failure().add_range_request(path, true);
-
-        TxnResponse response = commit_(context, bldr.get_transaction());
-        if (!response.succeeded()) {
-            if (response.mutable_responses(0)->release_response_range()->kvs_size()) {
-                throw EntryExists{};
-            }
-            // if compare failed but key does not exist the parent has to not exist
-            throw NoEntry{};
-        }
-
-        return 1;
+        return *watch_creators_[std::hash<std::string>{}(key) % watch_creators_.size()];
     }
 
-
-    ExistsResult exists(const Key& key, bool watch = false) override
+    RangeResponse range_(const std::string& path, bool keys_only = false)
     {
         grpc::ClientContext context;
-        auto path = as_path_string_(key);
 
         RangeRequest request;
         request.set_key(path);
         request.set_limit(1);
-        request.set_keys_only(true);
-        RangeResponse response;
+        request.set_keys_only(keys_only);
 
+        RangeResponse response;
         auto status = stub_->Range(&context, request, &response);
         detail::ensure_succeeded_(status);
 
-        bool exists = response.kvs_size();
-
-        std::unique_ptr<WatchHandle> watch_handle;
-        if (watch) {
-            ETCDWatchCreator::WatchCreateRequest watch_request;
-            watch_request.set_key(path);
-            watch_request.set_start_revision(response.header().revision() + 1);
-            watch_handle = make_watch_handle_(watch_request, [exists](const ETCDWatchCreator::Event& ev) {
-                return (ev.type() == ETCDWatchCreator::EventType::Event_EventType_DELETE && exists) ||
-                       (ev.type() == ETCDWatchCreator::EventType::Event_EventType_PUT && !exists);
-            });
-        }
-
-        return {
-            !exists ? 0 : static_cast<int64_t>(response.kvs(0).version()),
-            std::move(watch_handle)
-        };
+        return response;
     }
 
-
-    ChildrenResult get_children(const Key& key, bool watch = false) override
+    // counts the keys of the range if the key exists, no key is transferred
+    size_t count_(const Key& key, const std::pair<std::string, std::string>& range)
     {
         grpc::ClientContext context;
 
-        auto [key_begin, key_end] = make_direct_children_range_(key);
-
         ETCDTransactionBuilder bldr;
         bldr.add_check_exists(as_path_string_(key))
-            .on_success().add_range_request(std::make_pair(key_begin, key_end), true, 0);
+            .on_success().add_count_request(range);
 
         TxnResponse response = commit_(context, bldr.get_transaction());
         if (!response.succeeded()) throw NoEntry{};
 
-        std::vector<std::string> children;
-        std::set<std::string> raw_keys;
-        for (const auto& kv : response.mutable_responses(0)->release_response_range()->kvs()) {
-            children.emplace_back(unwrap_key_(kv.key()));
-            raw_keys.emplace(kv.key());
-        }
-
-        std::unique_ptr<WatchHandle> watch_handle;
-        if (watch) {
-            ETCDWatchCreator::WatchCreateRequest watch_request;
-            watch_request.set_key(key_begin);
-            watch_request.set_range_end(key_end);
-            watch_request.set_start_revision(response.header().revision() + 1);
-            watch_handle = make_watch_handle_(watch_request, [old_keys = std::move(raw_keys)](const ETCDWatchCreator::Event& ev) {
-                bool old = old_keys.find(ev.kv().key()) != old_keys.end();
-                return (old && ev.type() == ETCDWatchCreator::EventType::Event_EventType_DELETE) ||
-                       (!old && ev.type() == ETCDWatchCreator::EventType::Event_EventType_PUT);
-            });
-        }
-        return { std::move(children), std::move(watch_handle) };
+        return response.responses(0).response_range().count();
+    }
+
+    TxnResponse commit_(grpc::ClientContext& context, const TxnRequest& txn)
+    {
+        TxnResponse response;
+
+        auto status = stub_->Txn(&context, txn, &response);
+        detail::ensure_succeeded_(status);
+
+        return response;
+    }
+
+    struct EncodedTransaction_
+    {
+        TxnRequest request;
+        // the kind of each op's result and the index of its response in the success branch
+        std::vector<std::pair<TxnOpResult::Kind, size_t>> result_indices;
+        std::vector<std::vector<bool>> expected_existence;
+        // the mod revisions the VALUE_PREFIX checks are pinned to
+        std::map<size_t, int64_t> pinned_revisions;
+        // the index in the success branch of the put of each create or set op, with its lease
+        std::vector<std::pair<size_t, Lease>> value_puts;
+    };
+
+    // checks come first, so the i-th check is the i-th compare of the request
+    EncodedTransaction_ encode_transaction_(const Transaction& transaction)
+    {
+        EncodedTransaction_ encoded;
+        auto& result_indices = encoded.result_indices;
+        auto& expected_existence = encoded.expected_existence;
+        auto& pinned_revisions = encoded.pinned_revisions;
+        auto& value_puts = encoded.value_puts;
+        size_t success_index = 0;
+
+        ETCDTransactionBuilder bldr;
+
+        for (size_t i = 0; i < transaction.checks.size(); ++i) {
+            const auto& check = transaction.checks[i];
+            auto path = as_path_string_(check.key);
+            switch (check.kind) {
+                case TxnCheck::Kind::VERSION:
+                    bldr.add_version_compare(path, check.version);
+                    break;
+                case TxnCheck::Kind::VALUE:
+                    bldr.add_value_compare(path, check.value);
+                    break;
+                case TxnCheck::Kind::VALUE_PREFIX: {
+                    // etcd cannot compare a prefix, so the value is read and its revision is pinned
+                    auto range = range_(path);
+                    if (!range.kvs_size() || !check.matches(range.kvs(0).value())) throw TxnFailed{i};
+                    pinned_revisions[i] = range.kvs(0).mod_revision();
+                    bldr.add_mod_revision_compare(path, pinned_revisions[i]);
+                    break;
+                }
+                case TxnCheck::Kind::ABSENT:
+                    bldr.add_check_not_exists(path);
+                    break;
+            }
+            bldr.on_failure().add_range_request(path);
+        }
+
+        for (const auto& op : transaction.ops) {
+            std::visit([this, &expected_existence,
+                        &result_indices, &value_puts,
+                        &success_index, &bldr](auto&& arg) {
+                auto path = as_path_string_(arg.key);
+                using T = std::decay_t<decltype(arg)>;
+                if constexpr (std::is_same_v<T, TxnOpCreate>) {
+                    expected_existence.emplace_back();
+                    bldr.add_check_not_exists(path)
+                        .on_success().add_put_request(path, arg.value,
+                                                      lease_issuer_.get_lease(arg.lease))
+                        .on_failure().add_range_request(path, true);
+                    expected_existence.back().push_back(false);
+
+                    if (auto parent = arg.key.parent(); !parent.root()) {
+                        auto path = as_path_string_(parent);
+                        bldr.add_check_exists(path)
+                            .on_failure().add_range_request(path, true);
+                        expected_existence.back().push_back(true);
+                    }
+
+                    value_puts.emplace_back(success_index, arg.lease);
+                    result_indices.emplace_back(TxnOpResult::Kind::CREATE, success_index++);
+                } else if constexpr (std::is_same_v<T, TxnOpSet>) {
+                    expected_existence.emplace_back();
+
+                    bldr.add_check_exists(path)
+                        .on_success().add_put_request(path, arg.value)
+                                     .add_range_request(path)
+                        .on_failure().add_range_request(path, true);
+                    expected_existence.back().push_back(true);
+
+                    // skip put request
+                    value_puts.emplace_back(success_index++, Lease{});
+
+                    // save range request index
+                    result_indices.emplace_back(TxnOpResult::Kind::SET, success_index++);
+                } else if constexpr (std::is_same_v<T, TxnOpErase>) {
+                    expected_existence.emplace_back();
+
+                    bldr.add_check_exists(path)
+                        .on_success().add_delete_range_request(path)
+                                     .add_delete_range_request(make_subtree_range_(arg.key))
+                                     .add_delete_range_request(make_sequence_range_(arg.key))
+                        .on_failure().add_range_request(path, true);
+                    expected_existence.back().push_back(true);
+
+                    success_index += 3;
+                } else if constexpr (std::is_same_v<T, TxnOpGet>) {
+                    expected_existence.emplace_back();
+
+                    bldr.add_check_exists(path)
+                        .on_success().add_range_request(path)
+                        .on_failure().add_range_request(path, true);
+                    expected_existence.back().push_back(true);
+
+                    result_indices.emplace_back(TxnOpResult::Kind::GET, success_index++);
+                } else if constexpr (std::is_same_v<T, TxnOpGetChildren>) {
+                    expected_existence.emplace_back();
+
+                    bldr.add_check_exists(path)
+                        .on_success().add_range_request(make_direct_children_range_(arg.key), true, 0)
+                        .on_failure().add_range_request(path, true);
+                    expected_existence.back().push_back(true);
+
+                    result_indices.emplace_back(TxnOpResult::Kind::GET_CHILDREN, success_index++);
+                } else static_assert(detail::always_false<T>::value, "non-exhaustive visitor");
+            }, op);
+        }
+
+        encoded.request = std::move(bldr.get_transaction());
+        return encoded;
+    }
+
+    // returns nothing if a value read to emulate a VALUE_PREFIX check has changed since
+    std::optional<TransactionResult> decode_response_(const Transaction& transaction,
+                                                      const EncodedTransaction_& encoded,
+                                                      TxnResponse& response)
+    {
+        const auto& result_indices = encoded.result_indices;
+        const auto& expected_existence = encoded.expected_existence;
+        const auto& pinned_revisions = encoded.pinned_revisions;
+
+        if (!response.succeeded()) {
+            auto& responses = *response.mutable_responses();
+
+            bool pinned_value_changed = false;
+
+            // check if any check failed
+            for (size_t i = 0; i < transaction.checks.size(); ++i) {
+                const auto& check = transaction.checks[i];
+                const auto& range = responses[i].response_range();
+                if (check.kind == TxnCheck::Kind::ABSENT) {
+                    if (range.kvs_size()) throw TxnFailed{i};
+                    continue;
+                }
+                if (range.kvs_size() == 0 || (check.kind == TxnCheck::Kind::VERSION
+                                                  ? check.version != range.kvs(0).version()
+                                                  : !check.matches(range.kvs(0).value()))) {
+                    throw TxnFailed{i};
+                }
+                if (auto pinned = pinned_revisions.find(i);
+                        pinned != pinned_revisions.end() && pinned->second != range.kvs(0).mod_revision())
+                    pinned_value_changed = true;
+            }
+
+            size_t tr_checks_number = transaction.checks.size(), j = 0;
+            // check if any op failed
+            for (size_t i = 0; i < transaction.ops.size(); ++i) {
+                for (bool should_exist : expected_existence[i]) {
+                    if (should_exist ^ static_cast<bool>(responses[j + tr_checks_number]
+                                                            .release_response_range()
+                                                            ->kvs_size()))
+                        throw TxnFailed{i + tr_checks_number};
+                    ++j;
+                }
+            }
+
+            if (pinned_value_changed) return std::nullopt;
+            throw ServiceError{"we are sorry for your transaction"};
+        }
+
+        TransactionResult result;
+
+        for (const auto& [kind, index] : result_indices) {
+            switch (kind) {
+                case TxnOpResult::Kind::CREATE:
+                    result.push_back(TxnOpResult{kind, 1});
+                    break;
+                case TxnOpResult::Kind::SET: {
+                    const auto& kv = response.responses(index).response_range().kvs(0);
+                    result.push_back(TxnOpResult{kind, static_cast<int64_t>(kv.version())});
+                    break;
+                }
+                case TxnOpResult::Kind::GET: {
+                    const auto& kv = response.responses(index).response_range().kvs(0);
+                    result.push_back(TxnOpResult{kind, static_cast<int64_t>(kv.version()), kv.value()});
+                    break;
+                }
+                case TxnOpResult::Kind::GET_CHILDREN: {
+                    std::vector<std::string> children;
+                    for (const auto& kv : response.responses(index).response_range().kvs())
+                        children.emplace_back(unwrap_key_(kv.key()));
+                    result.push_back(TxnOpResult{kind, 0, {}, std::move(children)});
+                    break;
+                }
+            }
+        }
+        return result;
+    }
+
+    std::optional<TransactionResult> try_commit_(const Transaction& transaction)
+    {
+        auto encoded = encode_transaction_(transaction);
+
+        grpc::ClientContext context;
+        TxnResponse response = commit_(context, encoded.request);
+        return decode_response_(transaction, encoded, response);
+    }
+
+    // the request is encoded once and only patched with the versions and values
+    class PreparedTransaction_ : public PreparedTransaction
+    {
+    public:
+        PreparedTransaction_(ETCDClient& client, Transaction shape)
+            : client_(client)
+            , shape_(std::move(shape))
+            , encoded_(client_.encode_transaction_(shape_))
+        {}
+
+        TransactionResult commit(const std::vector<int64_t>& versions,
+                                 const std::vector<std::string>& values) override
+        {
+            if (versions.size() != shape_.checks.size() || values.size() != encoded_.value_puts.size())
+                throw std::invalid_argument("wrong number of arguments for a prepared transaction");
+
+            auto request = encoded_.request;
+            for (size_t i = 0; i < versions.size(); ++i)
+                if (shape_.checks[i].kind == TxnCheck::Kind::VERSION)
+                    request.mutable_compare(static_cast<int>(i))->set_version(versions[i]);
+            for (size_t j = 0; j < values.size(); ++j) {
+                const auto& [index, lease] = encoded_.value_puts[j];
+                auto put = request.mutable_success(static_cast<int>(index))->mutable_request_put();
+                put->set_value(values[j]);
+                // the lease may have been lost and granted anew since the transaction was encoded
+                if (lease) put->set_lease(client_.lease_issuer_.get_lease(lease));
+            }
+
+            grpc::ClientContext context;
+            TxnResponse response = client_.commit_(context, request);
+            if (response.succeeded())
+                return *client_.decode_response_(shape_, encoded_, response);
+
+            // the checks are only filled in to find out which of them has failed
+            auto transaction = shape_;
+            bind_(transaction, versions, values);
+            return *client_.decode_response_(transaction, encoded_, response);
+        }
+
+    private:
+        ETCDClient& client_;
+        Transaction shape_;
+        EncodedTransaction_ encoded_;
+    };
+
+
+    using Subscription_ = std::unique_ptr<ETCDWatchCreator::Subscription>;
+
+    // each handle owns its subscription, so dropping the handle cancels the server-side watch
+
+    class ETCDWatchHandle_ : public WatchHandle {
+    private:
+        std::shared_future<void> future_;
+        Subscription_ subscription_;
+
+    public:
+        ETCDWatchHandle_(std::shared_future<void>&& future, Subscription_ subscription)
+            : future_(std::move(future)), subscription_(std::move(subscription))
+        {}
+
+        void wait() override { future_.get(); }
+    };
+
+    class ETCDValueWatchHandle_ : public ValueWatchHandle {
+    private:
+        std::shared_future<WatchedValue> future_;
+        Subscription_ subscription_;
+
+    public:
+        ETCDValueWatchHandle_(std::shared_future<WatchedValue>&& future, Subscription_ subscription)
+            : future_(std::move(future)), subscription_(std::move(subscription))
+        {}
+
+        WatchedValue wait() override { return future_.get(); }
+    };
+
+    // accumulates events delivered by the watch resolution thread until the handle takes them
+    template <typename Batch>
+    class WatchStream_ {
+    private:
+        std::mutex lock_;
+        std::condition_variable cv_;
+        Batch batch_;
+        std::exception_ptr error_;
+
+    public:
+        template <typename Updater>
+        void update(Updater&& updater)
+        {
+            std::lock_guard lock(lock_);
+            updater(batch_);
+            cv_.notify_all();
+        }
+
+        // the first error wins, it is thrown once the batch is taken
+        void fail(std::exception_ptr error)
+        {
+            std::lock_guard lock(lock_);
+            if (!error_) error_ = std::move(error);
+            cv_.notify_all();
+        }
+
+        Batch take()
+        {
+            std::unique_lock lock(lock_);
+            cv_.wait(lock, [this] { return error_ || !batch_.empty(); });
+
+            if (batch_.empty()) std::rethrow_exception(error_);
+            return std::exchange(batch_, {});
+        }
+    };
+
+    template <typename Handle, typename Batch>
+    class ETCDStreamWatchHandle_ : public Handle {
+    private:
+        std::shared_ptr<WatchStream_<Batch>> stream_;
+        Subscription_ subscription_;
+        // the watch of the parent key, if any
+        Subscription_ parent_subscription_;
+
+    public:
+        ETCDStreamWatchHandle_(std::shared_ptr<WatchStream_<Batch>> stream, Subscription_ subscription,
+                               Subscription_ parent_subscription = {})
+            : stream_(std::move(stream)), subscription_(std::move(subscription)),
+              parent_subscription_(std::move(parent_subscription))
+        {}
+
+        Batch wait() override { return stream_->take(); }
+    };
+
+
+    template <typename EventChecker>
+    std::unique_ptr<WatchHandle> make_watch_handle_(
+            const ETCDWatchCreator::WatchCreateRequest& request,
+            EventChecker&& stop_waiting_condition
+        )
+    {
+        auto promise = std::make_shared<std::promise<void>>();
+        auto subscription = watch_creator_for_(request.key()).create_watch(
+            request,
+            {
+                [promise, foo = std::forward<EventChecker>(stop_waiting_condition)]
+                    (const ETCDWatchCreator::Event& event) mutable
+                {
+                    if (foo(event)) {
+                        promise->set_value();
+                        return true;
+                    }
+                    return false;
+                },
+                [promise](const ServiceError& exc)
+                {
+                    promise->set_exception(std::make_exception_ptr(exc));
+                }
+            });
+        return std::make_unique<ETCDWatchHandle_>(promise->get_future().share(), std::move(subscription));
+    }
+
+    // the watch lives as long as the handle; EventProcessor adds an event to the batch;
+    // once the parent key (if given) is erased, the handle throws NoEntry after the last batch
+    template <typename Handle, typename Batch, typename EventProcessor>
+    std::unique_ptr<Handle> make_stream_watch_handle_(
+            const ETCDWatchCreator::WatchCreateRequest& request,
+            EventProcessor&& process_event,
+            const std::string& parent_path = {}
+        )
+    {
+        auto stream = std::make_shared<WatchStream_<Batch>>();
+        // both watches go over the same stream not to reorder their events
+        auto& watch_creator = watch_creator_for_(request.key());
+        auto subscription = watch_creator.create_watch(
+            request,
+            {
+                [weak_stream = std::weak_ptr(stream), foo = std::forward<EventProcessor>(process_event)]
+                    (const ETCDWatchCreator::Event& event) mutable
+                {
+                    auto stream = weak_stream.lock();
+                    // the handle is destroyed, stop watching
+                    if (!stream) return true;
+
+                    stream->update([&foo, &event](Batch& batch) { foo(batch, event); });
+                    return false;
+                },
+                [weak_stream = std::weak_ptr(stream)](const ServiceError& exc)
+                {
+                    if (auto stream = weak_stream.lock()) stream->fail(std::make_exception_ptr(exc));
+                }
+            });
+
+        Subscription_ parent_subscription;
+        if (!parent_path.empty()) {
+            ETCDWatchCreator::WatchCreateRequest parent_request;
+            parent_request.set_key(parent_path);
+            parent_request.set_start_revision(request.start_revision());
+            parent_subscription = watch_creator.create_watch(
+                parent_request,
+                {
+                    [weak_stream = std::weak_ptr(stream)](const ETCDWatchCreator::Event& event)
+                    {
+                        if (event.type() != ETCDWatchCreator::EventType::Event_EventType_DELETE) return false;
+                        if (auto stream = weak_stream.lock()) stream->fail(std::make_exception_ptr(NoEntry{}));
+                        return true;
+                    },
+                    [weak_stream = std::weak_ptr(stream)](const ServiceError& exc)
+                    {
+                        if (auto stream = weak_stream.lock()) stream->fail(std::make_exception_ptr(exc));
+                    }
+                });
+        }
+
+        return std::make_unique<ETCDStreamWatchHandle_<Handle, Batch>>(
+            std::move(stream), std::move(subscription), std::move(parent_subscription));
+    }
+
+
+    int64_t create_(const Key& key, const std::string& value, int64_t lease_id)
+    {
+        grpc::ClientContext context;
+        ETCDTransactionBuilder bldr;
+
+        auto path = as_path_string_(key);
+
+        if (auto parent = key.parent(); !parent.root()) bldr.add_check_exists(as_path_string_(parent));
+
+        bldr.add_check_not_exists(path)
+            // on success put value
+            .on_success().add_put_request(path, value, lease_id)
+            // on failure perform get request to determine a kind of error
+            .on_failure().add_range_request(path, true);
+
+        TxnResponse response = commit_(context, bldr.get_transaction());
+        if (!response.succeeded()) {
+            if (response.mutable_responses(0)->release_response_range()->kvs_size()) {
+                throw EntryExists{};
+            }
+            // if compare failed but key does not exist the parent has to not exist
+            throw NoEntry{};
+        }
+
+        return 1;
+    }
+
+
+    using Address_ = std::pair<std::string, std::map<std::string, std::string>>;
+
+    // keep-alives get a connection of their own unless told otherwise,
+    // so that bulk requests queued on the main one never delay them past the TTL
+    static std::shared_ptr<grpc::Channel> make_lease_channel_(const Address_& address,
+                                                              const std::shared_ptr<grpc::Channel>& channel)
+    {
+        if (!detail::get_bool_param(address.second, "dedicated_lease_channel", true)) return channel;
+
+        grpc::ChannelArguments args;
+        // channels with equal arguments share subchannels (and connections) by default
+        args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+        return grpc::CreateCustomChannel(address.first, grpc::InsecureChannelCredentials(), args);
+    }
+
+    ETCDClient(const Address_& address, Path prefix)
+        : Client(std::move(prefix)),
+          channel_(grpc::CreateChannel(address.first, grpc::InsecureChannelCredentials())),
+          stub_(KV::NewStub(channel_)),
+          lease_monitor_(std::make_shared<detail::LeaseMonitor>()),
+          lease_issuer_(make_lease_channel_(address, channel_), lease_monitor_)
+    {
+        auto watch_streams = detail::get_count_param(address.second, "watch_streams", 1, MAX_WATCH_STREAMS);
+        for (size_t i = 0; i < watch_streams; ++i)
+            watch_creators_.push_back(std::make_shared<ETCDWatchCreator>(channel_));
+    }
+
+
+public:
+    // address may carry options: "host:port?watch_streams=4"
+    ETCDClient(const std::string& address, Path prefix)
+        : ETCDClient(detail::split_query(address), std::move(prefix))
+    {}
+
+
+    int64_t create(const Key& key, const std::string& value, Lease lease = {}) override
+    {
+        return create_(key, value, lease_issuer_.get_lease(lease));
+    }
+
+    int64_t create(const Key& key, const std::string& value, std::chrono::seconds ttl) override
+    {
+        return create_(key, value, lease_issuer_.get_expiring_lease(ttl));
+    }
+
+
+    // the counter is compared and incremented in the same transaction that puts the child,
+    // see sequence_counter_
+    std::string create_sequential(const Key& parent, const std::string& value, Lease lease = {}) override
+    {
+        static constexpr size_t NAME_WIDTH = 20;
+
+        auto parent_path = as_path_string_(parent);
+        auto counter_path = sequence_counter_(parent);
+        auto lease_id = lease_issuer_.get_lease(lease);
+
+        RangeResponse counter_range = range_(counter_path);
+        uint64_t counter = counter_range.kvs_size() ? std::stoull(counter_range.kvs(0).value()) : 0;
+        // a missing key has a zero mod revision
+        int64_t counter_revision = counter_range.kvs_size() ? counter_range.kvs(0).mod_revision() : 0;
+
+        while (true) {
+            auto name = detail::sequential_name(++counter, NAME_WIDTH);
+            auto path = as_path_string_(Key{static_cast<std::string>(parent) + "/" + name});
+
+            grpc::ClientContext context;
+            ETCDTransactionBuilder bldr;
+            bldr.add_check_exists(parent_path)
+                .add_mod_revision_compare(counter_path, counter_revision)
+                .add_check_not_exists(path)
+                .on_success().add_put_request(counter_path, std::to_string(counter))
+                             .add_put_request(path, value, lease_id)
+                .on_failure().add_range_request(parent_path, true)
+                             .add_range_request(counter_path);
+
+            TxnResponse response = commit_(context, bldr.get_transaction());
+            if (response.succeeded()) return name;
+
+            if (!response.responses(0).response_range().kvs_size()) throw NoEntry{};
+
+            // the counter has moved on, otherwise the name is taken by a key created otherwise
+            const auto& current = response.responses(1).response_range();
+            int64_t current_revision = current.kvs_size() ? current.kvs(0).mod_revision() : 0;
+            if (current_revision != counter_revision) {
+                counter = current.kvs_size() ? std::stoull(current.kvs(0).value()) : 0;
+                counter_revision = current_revision;
+            }
+        }
+    }
+
+
+    ExistsResult exists(const Key& key, bool watch = false) override
+    {
+        auto path = as_path_string_(key);
+        RangeResponse response = range_(path, true);
+
+        bool exists = response.kvs_size();
+
+        std::unique_ptr<WatchHandle> watch_handle;
+        if (watch) {
+            ETCDWatchCreator::WatchCreateRequest watch_request;
+            watch_request.set_key(path);
+            watch_request.set_start_revision(response.header().revision() + 1);
+            watch_handle = make_watch_handle_(watch_request, [exists](const ETCDWatchCreator::Event& ev) {
+                return (ev.type() == ETCDWatchCreator::EventType::Event_EventType_DELETE && exists) ||
+                       (ev.type() == ETCDWatchCreator::EventType::Event_EventType_PUT && !exists);
+            });
+        }
+
+        return {
+            !exists ? 0 : static_cast<int64_t>(response.kvs(0).version()),
+            std::move(watch_handle)
+        };
+    }
+
+
+    ChildrenResult get_children(const Key& key, bool watch = false) override
+    {
+        grpc::ClientContext context;
+
+        auto [key_begin, key_end] = make_direct_children_range_(key);
+
+        ETCDTransactionBuilder bldr;
+        bldr.add_check_exists(as_path_string_(key))
+            .on_success().add_range_request(std::make_pair(key_begin, key_end), true, 0);
+
+        TxnResponse response = commit_(context, bldr.get_transaction());
+        if (!response.succeeded()) throw NoEntry{};
+
+        std::vector<std::string> children;
+        std::set<std::string> raw_keys;
+        for (const auto& kv : response.mutable_responses(0)->release_response_range()->kvs()) {
+            children.emplace_back(unwrap_key_(kv.key()));
+            raw_keys.emplace(kv.key());
+        }
+
+        std::unique_ptr<WatchHandle> watch_handle;
+        if (watch) {
+            ETCDWatchCreator::WatchCreateRequest watch_request;
+            watch_request.set_key(key_begin);
+            watch_request.set_range_end(key_end);
+            watch_request.set_start_revision(response.header().revision() + 1);
+            watch_handle = make_watch_handle_(watch_request, [old_keys = std::move(raw_keys)](const ETCDWatchCreator::Event& ev) {
+                bool old = old_keys.find(ev.kv().key()) != old_keys.end();
+                return (old && ev.type() == ETCDWatchCreator::EventType::Event_EventType_DELETE) ||
+                       (!old && ev.type() == ETCDWatchCreator::EventType::Event_EventType_PUT);
+            });
+        }
+        return { std::move(children), std::move(watch_handle) };
+    }
+
+
+    PmrChildren get_children(const Key& key, std::pmr::memory_resource* resource) override
+    {
+        grpc::ClientContext context;
+
+        ETCDTransactionBuilder bldr;
+        bldr.add_check_exists(as_path_string_(key))
+            .on_success().add_range_request(make_direct_children_range_(key), true, 0);
+
+        TxnResponse response = commit_(context, bldr.get_transaction());
+        if (!response.succeeded()) throw NoEntry{};
+
+        const auto& kvs = response.responses(0).response_range().kvs();
+        PmrChildren children(resource);
+        children.reserve(kvs.size());
+        for (const auto& kv : kvs)
+            children.push_back(unwrap_key_<std::pmr::string>(kv.key(), resource));
+        return children;
+    }
+
+
+    // "{key}/\0{child}" keys sort by the child name, so the server sorts and limits them
+    std::vector<std::string> get_children(const Key& key, const ChildrenQuery& query) override
+    {
+        grpc::ClientContext context;
+
+        auto range = make_direct_children_range_(key);
+        auto limit = static_cast<int64_t>(query.limit);
+
+        ETCDTransactionBuilder bldr;
+        bldr.add_check_exists(as_path_string_(key)).on_success();
+        if (query.order == ChildrenQuery::Order::NONE) bldr.add_range_request(range, true, limit);
+        else bldr.add_sorted_range_request(range, query.order == ChildrenQuery::Order::DESCEND, limit);
+
+        TxnResponse response = commit_(context, bldr.get_transaction());
+        if (!response.succeeded()) throw NoEntry{};
+
+        std::vector<std::string> children;
+        for (const auto& kv : response.mutable_responses(0)->release_response_range()->kvs())
+            children.emplace_back(unwrap_key_(kv.key()));
+        return children;
+    }
+
+
+    StatResult stat(const Key& key) override
+    {
+        grpc::ClientContext context;
+
+        auto path = as_path_string_(key);
+
+        ETCDTransactionBuilder bldr;
+        bldr.add_check_exists(path)
+            .on_success().add_range_request(path, true)
+                         .add_count_request(make_direct_children_range_(key));
+
+        TxnResponse response = commit_(context, bldr.get_transaction());
+        if (!response.succeeded()) throw NoEntry{};
+
+        const auto& kv = response.responses(0).response_range().kvs(0);
+        return {
+            static_cast<int64_t>(kv.version()),
+            kv.create_revision(),
+            kv.mod_revision(),
+            std::nullopt,
+            static_cast<size_t>(response.responses(1).response_range().count()),
+            kv.lease() ? std::to_string(kv.lease()) : std::string{}
+        };
+    }
+
+    size_t count_children(const Key& key) override
+    {
+        return count_(key, make_direct_children_range_(key));
+    }
+
+    size_t count_subtree(const Key& key) override
+    {
+        return count_(key, make_subtree_range_(key));
+    }
+
+
+    ChildrenWatchResult watch_children(const Key& key) override
+    {
+        grpc::ClientContext context;
+
+        auto [key_begin, key_end] = make_direct_children_range_(key);
+
+        ETCDTransactionBuilder bldr;
+        bldr.add_check_exists(as_path_string_(key))
+            .on_success().add_range_request(std::make_pair(key_begin, key_end), true, 0);
+
+        TxnResponse response = commit_(context, bldr.get_transaction());
+        if (!response.succeeded()) throw NoEntry{};
+
+        std::vector<std::string> children;
+        for (const auto& kv : response.mutable_responses(0)->release_response_range()->kvs())
+            children.emplace_back(unwrap_key_(kv.key()));
+
+        ETCDWatchCreator::WatchCreateRequest watch_request;
+        watch_request.set_key(key_begin);
+        watch_request.set_range_end(key_end);
+        watch_request.set_start_revision(response.header().revision() + 1);
+
+        // all the events happen after the listing, so the only state needed is the pending delta:
+        // a put of a key with version 1 is a creation, any other put is an update
+        auto watch_handle = make_stream_watch_handle_<ChildrenWatchHandle, ChildrenDelta>(
+            watch_request,
+            [this](ChildrenDelta& delta, const ETCDWatchCreator::Event& event) {
+                bool removed = event.type() == ETCDWatchCreator::EventType::Event_EventType_DELETE;
+                if (removed || event.kv().version() == 1)
+                    detail::add_child_change(delta, unwrap_key_(event.kv().key()), removed);
+            },
+            as_path_string_(key));
+
+        return { std::move(children), std::move(watch_handle) };
+    }
+
+
+    std::unique_ptr<SubtreeWatchHandle> watch_subtree(const Key& key) override
+    {
+        auto path = as_path_string_(key);
+        RangeResponse response = range_(path, true);
+        if (!response.kvs_size()) throw NoEntry{};
+
+        auto [key_begin, key_end] = make_subtree_range_(key);
+
+        ETCDWatchCreator::WatchCreateRequest watch_request;
+        watch_request.set_key(key_begin);
+        watch_request.set_range_end(key_end);
+        watch_request.set_start_revision(response.header().revision() + 1);
+
+        return make_stream_watch_handle_<SubtreeWatchHandle, std::vector<SubtreeChange>>(
+            watch_request,
+            [this](std::vector<SubtreeChange>& changes, const ETCDWatchCreator::Event& event) {
+                changes.push_back({
+                    unwrap_key_(event.kv().key()),
+                    event.type() == ETCDWatchCreator::EventType::Event_EventType_DELETE
+                        ? 0 : static_cast<int64_t>(event.kv().version())
+                });
+            },
+            path);
     }
 
 
@@ -738,7 +1742,9 @@ public:
             try {
                 return {create(key, value)};
             } catch (EntryExists&) {
-                return {0};
+                auto current = range_(as_path_string_(key));
+                if (!current.kvs_size()) return {0};
+                return {0, current.kvs(0).version(), current.kvs(0).value()};
             }
         }
 
@@ -750,12 +1756,13 @@ public:
         bldr.add_version_compare(path, version)
             .on_success().add_put_request(path, value, 0, true)
                          .add_range_request(path, true)
-            .on_failure().add_range_request(path, true);
+            .on_failure().add_range_request(path);
 
         TxnResponse response = commit_(context, bldr.get_transaction());
         if (!response.succeeded()) {
-            auto failure_response = response.mutable_responses(0)->release_response_range();
-            if (failure_response->kvs_size()) return {0};
+            const auto& failure_response = response.responses(0).response_range();
+            if (failure_response.kvs_size())
+                return {0, failure_response.kvs(0).version(), failure_response.kvs(0).value()};
 
             // ! throw NoEntry if version != 0 and key doesn't exist
             throw NoEntry{};
@@ -767,17 +1774,8 @@ public:
 
     GetResult get(const Key& key, bool watch = false) override
     {
-        grpc::ClientContext context;
         auto path = as_path_string_(key);
-
-        RangeRequest request;
-        request.set_key(path);
-        request.set_limit(1);
-
-        RangeResponse response;
-        auto status = stub_->Range(&context, request, &response);
-
-        detail::ensure_succeeded_(status);
+        RangeResponse response = range_(path);
 
         if (!response.kvs_size()) throw NoEntry{};
 
@@ -795,142 +1793,145 @@ public:
     }
 
 
-    void erase(const Key& key, int64_t version = 0) override
+    PmrGetResult get(const Key& key, std::pmr::memory_resource* resource) override
     {
-        auto path = as_path_string_(key);
+        RangeResponse response = range_(as_path_string_(key));
+        if (!response.kvs_size()) throw NoEntry{};
+
+        const auto& kv = response.kvs(0);
+        return { static_cast<int64_t>(kv.version()), std::pmr::string(kv.value(), resource) };
+    }
+
 
+    // the value is only read in the failure branch of the version compare
+    GetIfChangedResult get_if_changed(const Key& key, int64_t known_version) override
+    {
         grpc::ClientContext context;
-        ETCDTransactionBuilder bldr;
 
-        if (version) bldr.add_version_compare(path, version);
-        else         bldr.add_check_exists(path);
+        auto path = as_path_string_(key);
 
-        bldr.on_success().add_delete_range_request(path)
-                         .add_delete_range_request(make_subtree_range_(key))
-            .on_failure().add_range_request(path, true);
+        ETCDTransactionBuilder bldr;
+        bldr.add_check_exists(path)
+            .add_version_compare(path, known_version)
+            .on_failure().add_range_request(path);
 
         TxnResponse response = commit_(context, bldr.get_transaction());
-        if (!response.succeeded() && !response.mutable_responses(0)->release_response_range()->count()) {
-            throw NoEntry{};
-        }
+        if (response.succeeded()) return {known_version, std::nullopt};
+
+        const auto& range = response.responses(0).response_range();
+        if (!range.kvs_size()) throw NoEntry{};
+
+        return {static_cast<int64_t>(range.kvs(0).version()), range.kvs(0).value()};
     }
 
 
-    TransactionResult commit(const Transaction& transaction) override
+    ValueWatchResult watch_value(const Key& key) override
     {
-        grpc::ClientContext context;
-
-        std::vector<size_t> set_indices, create_indices;
-        std::vector<std::vector<bool>> expected_existence;
-        size_t total_op_number = 0;
+        auto path = as_path_string_(key);
+        RangeResponse response = range_(path);
 
-        ETCDTransactionBuilder bldr;
+        if (!response.kvs_size()) throw NoEntry{};
 
-        for (const auto& check : transaction.checks) {
-            auto path = as_path_string_(check.key);
-            bldr.add_version_compare(path, check.version)
-                .on_failure().add_range_request(path);
-        }
+        ETCDWatchCreator::WatchCreateRequest watch_request;
+        watch_request.set_key(path);
+        watch_request.set_start_revision(response.header().revision() + 1);
 
-        for (const auto& op : transaction.ops) {
-            std::visit([this, &expected_existence,
-                        &create_indices, &set_indices,
-                        &total_op_number, &bldr](auto&& arg) {
-                auto path = as_path_string_(arg.key);
-                using T = std::decay_t<decltype(arg)>;
-                if constexpr (std::is_same_v<T, TxnOpCreate>) {
-                    expected_existence.emplace_back();
-                    bldr.add_check_not_exists(path)
-                        .on_success().add_put_request(path, arg.value,
-                                                      arg.lease ? lease_issuer_.get_lease() : 0)
-                        .on_failure().add_range_request(path, true);
-                    expected_existence.back().push_back(false);
+        // the event already holds the new kv, so there is no need to read it again
+        auto promise = std::make_shared<std::promise<WatchedValue>>();
+        auto subscription = watch_creator_for_(watch_request.key()).create_watch(
+            watch_request,
+            {
+                [promise](const ETCDWatchCreator::Event& event)
+                {
+                    if (event.type() == ETCDWatchCreator::EventType::Event_EventType_DELETE)
+                        promise->set_value({0, {}});
+                    else
+                        promise->set_value({static_cast<int64_t>(event.kv().version()), event.kv().value()});
+                    return true;
+                },
+                [promise](const ServiceError& exc)
+                {
+                    promise->set_exception(std::make_exception_ptr(exc));
+                }
+            });
 
-                    if (auto parent = arg.key.parent(); !parent.root()) {
-                        auto path = as_path_string_(parent);
-                        bldr.add_check_exists(path)
-                            .on_failure().add_range_request(path, true);
-                        expected_existence.back().push_back(true);
-                    }
+        auto kv = response.kvs(0);
+        return {
+            static_cast<int64_t>(kv.version()),
+            kv.value(),
+            std::make_unique<ETCDValueWatchHandle_>(promise->get_future().share(), std::move(subscription))
+        };
+    }
 
-                    create_indices.push_back(total_op_number++);
-                } else if constexpr (std::is_same_v<T, TxnOpSet>) {
-                    expected_existence.emplace_back();
 
-                    bldr.add_check_exists(path)
-                        .on_success().add_put_request(path, arg.value)
-                                     .add_range_request(path)
-                        .on_failure().add_range_request(path, true);
-                    expected_existence.back().push_back(true);
+    void erase(const Key& key, int64_t version = 0) override
+    {
+        auto path = as_path_string_(key);
 
-                    // skip put request
-                    ++total_op_number;
+        grpc::ClientContext context;
+        ETCDTransactionBuilder bldr;
 
-                    // save range request index
-                    set_indices.push_back(total_op_number++);
-                } else if constexpr (std::is_same_v<T, TxnOpErase>) {
-                    expected_existence.emplace_back();
+        if (version) bldr.add_version_compare(path, version);
+        else         bldr.add_check_exists(path);
 
-                    bldr.add_check_exists(path)
-                        .on_success().add_delete_range_request(path)
-                                     .add_delete_range_request(make_subtree_range_(arg.key))
-                        .on_failure().add_range_request(path, true);
-                    expected_existence.back().push_back(true);
+        bldr.on_success().add_delete_range_request(path)
+                         .add_delete_range_request(make_subtree_range_(key))
+                         .add_delete_range_request(make_sequence_range_(key))
+            .on_failure().add_range_request(path, true);
 
-                    ++total_op_number;
-                } else static_assert(detail::always_false<T>::value, "non-exhaustive visitor");
-            }, op);
+        TxnResponse response = commit_(context, bldr.get_transaction());
+        if (!response.succeeded() && !response.mutable_responses(0)->release_response_range()->count()) {
+            throw NoEntry{};
         }
+    }
 
-        TxnResponse response = commit_(context, bldr.get_transaction());
 
-        if (!response.succeeded()) {
-            auto& responses = *response.mutable_responses();
+    using Client::commit;
 
-            // check if any check failed
-            for (size_t i = 0; i < transaction.checks.size(); ++i) {
-                auto resp_i = responses[i].release_response_range();
-                if (resp_i->kvs_size() == 0 || transaction.checks[i].version != resp_i->kvs(0).version()) {
-                    throw TxnFailed{i};
-                }
-            }
+    TransactionResult commit(const Transaction& transaction) override
+    {
+        while (true)
+            if (auto result = try_commit_(transaction)) return std::move(*result);
+    }
 
-            size_t tr_checks_number = transaction.checks.size(), j = 0;
-            // check if any op failed
-            for (size_t i = 0; i < transaction.ops.size(); ++i) {
-                for (bool should_exist : expected_existence[i]) {
-                    if (should_exist ^ static_cast<bool>(responses[j + tr_checks_number]
-                                                            .release_response_range()
-                                                            ->kvs_size()))
-                        throw TxnFailed{i + tr_checks_number};
-                    ++j;
-                }
+
+    // the view is encoded with empty values, which are then copied straight into the request
+    TransactionResult commit(const TransactionView& view) override
+    {
+        const auto shape = detail::to_transaction(view, false);
+        while (true) {
+            auto encoded = encode_transaction_(shape);
+
+            size_t j = 0;
+            for (size_t i = 0; i < view.nops; ++i) {
+                const auto& op = view.ops[i];
+                if (op.kind != TxnOpView::Kind::CREATE && op.kind != TxnOpView::Kind::SET) continue;
+                encoded.request.mutable_success(static_cast<int>(encoded.value_puts[j++].first))
+                               ->mutable_request_put()
+                               ->set_value(op.value.data(), op.value.size());
             }
 
-            throw ServiceError{"we are sorry for your transaction"};
+            grpc::ClientContext context;
+            TxnResponse response = commit_(context, encoded.request);
+            if (auto result = decode_response_(shape, encoded, response)) return std::move(*result);
         }
+    }
 
-        TransactionResult result;
 
-        size_t i = 0, j = 0;
-        while (i != create_indices.size() || j != set_indices.size()) {
-            if (j == set_indices.size()
-                || (i != create_indices.size() && create_indices[i] < set_indices[j])) {
-                result.push_back(TxnOpResult{TxnOpResult::Kind::CREATE, 1});
-                ++i;
-            } else {
-                result.push_back(TxnOpResult{
-                    TxnOpResult::Kind::SET,
-                    static_cast<int64_t>(
-                        response.mutable_responses(set_indices[j])
-                                ->release_response_range()
-                                ->kvs(0)
-                                .version())
-                });
-                ++j;
-            }
-        }
-        return result;
+    // a VALUE_PREFIX check takes a read before every commit, such shapes are not encoded in advance
+    std::unique_ptr<PreparedTransaction> prepare(Transaction shape) override
+    {
+        const bool has_prefix_checks = std::any_of(shape.checks.begin(), shape.checks.end(), [](const TxnCheck& check) {
+            return check.kind == TxnCheck::Kind::VALUE_PREFIX;
+        });
+        if (has_prefix_checks) return Client::prepare(std::move(shape));
+        return std::make_unique<PreparedTransaction_>(*this, std::move(shape));
+    }
+
+
+    void set_lease_warning_handler(std::chrono::milliseconds min_margin, LeaseWarningHandler handler) override
+    {
+        lease_monitor_->set_handler(min_margin, std::move(handler));
     }
 };
 
@@ -1,16 +1,27 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <vector>
+#include <array>
+#include <cstddef>
+#include <type_traits>
 #include "errors.hpp"
 
 namespace liboffkv {
 
+template<size_t N>
+class KeyTemplate;
+
 class Path
 {
 private:
-    static bool validate_segment_(const std::string &segment)
+    template<size_t N>
+    friend class KeyTemplate;
+
+    // constexpr so that KeyTemplate can check its constant segments at compile time
+    static constexpr bool validate_segment_(std::string_view segment)
     {
         for (unsigned char c : segment)
             if (c <= 0x1F || c >= 0x7F)
@@ -24,6 +35,13 @@ private:
 protected:
     std::string path_;
 
+    struct Validated_ {};
+
+    // for paths that are already known to be valid
+    Path(std::string path, Validated_)
+        : path_(std::move(path))
+    {}
+
 public:
     std::vector<std::string> segments() const
     {
@@ -66,6 +84,14 @@ public:
 
 class Key : public Path
 {
+private:
+    template<size_t N>
+    friend class KeyTemplate;
+
+    Key(std::string key, Validated_ validated)
+        : Path(std::move(key), validated)
+    {}
+
 public:
     template<class T>
     Key(T &&key)
@@ -76,4 +102,89 @@ public:
     }
 };
 
+// A key pattern with "{}" in place of whole segments, e.g. "/services/{}/nodes/{}". Declared
+// constexpr, it has its constant segments validated at compile time (an invalid pattern does
+// not compile), so make() only validates the substituted segments.
+template<size_t N>
+class KeyTemplate
+{
+private:
+    static constexpr std::string_view PLACEHOLDER = "{}";
+
+    char pattern_[N];
+    // the offsets of the placeholders in the pattern
+    size_t placeholders_[N];
+    size_t nplaceholders_;
+
+    template<class T>
+    static std::string to_segment_(const T &segment)
+    {
+        if constexpr (std::is_integral_v<T>)
+            return std::to_string(segment);
+        else
+            return std::string(std::string_view(segment));
+    }
+
+public:
+    constexpr KeyTemplate(const char (&pattern)[N])
+        : pattern_{}
+        , placeholders_{}
+        , nplaceholders_{0}
+    {
+        for (size_t i = 0; i < N; ++i)
+            pattern_[i] = pattern[i];
+
+        const std::string_view view(pattern_, N - 1);
+        if (view.empty() || view[0] != '/')
+            throw InvalidKey{std::string(view)};
+
+        for (size_t begin = 1;;) {
+            size_t end = begin;
+            while (end < view.size() && view[end] != '/')
+                ++end;
+
+            const auto segment = view.substr(begin, end - begin);
+            if (segment == PLACEHOLDER)
+                placeholders_[nplaceholders_++] = begin;
+            else if (segment.find(PLACEHOLDER) != std::string_view::npos || !Path::validate_segment_(segment))
+                throw InvalidKey{std::string(view)};
+
+            if (end == view.size())
+                break;
+            begin = end + 1;
+        }
+    }
+
+    constexpr size_t placeholders() const { return nplaceholders_; }
+
+    // segments are strings or integers
+    template<class... Segments>
+    Key make(const Segments &...segments) const
+    {
+        if (sizeof...(segments) != nplaceholders_)
+            throw InvalidKey{std::string(pattern_, N - 1)};
+
+        const std::array<std::string, sizeof...(Segments)> values{{to_segment_(segments)...}};
+
+        size_t length = N - 1 - PLACEHOLDER.size() * nplaceholders_;
+        for (const auto &value : values) {
+            if (!Path::validate_segment_(value) || value.find('/') != std::string::npos)
+                throw InvalidKey{value};
+            length += value.size();
+        }
+
+        std::string path;
+        path.reserve(length);
+        size_t from = 0;
+        for (size_t i = 0; i < values.size(); ++i) {
+            path.append(pattern_ + from, placeholders_[i] - from);
+            path += values[i];
+            from = placeholders_[i] + PLACEHOLDER.size();
+        }
+        path.append(pattern_ + from, N - 1 - from);
+
+        return Key(std::move(path), Path::Validated_{});
+    }
+};
+
 } // namespace liboffkv
@@ -45,4 +45,74 @@ std::unique_ptr<Client> open(std::string url, Path prefix = "")
     throw InvalidAddress("protocol not supported: " + protocol);
 }
 
+
+namespace detail {
+
+// The URL protocol of the backend and whether its constructor takes the whole URL or
+// only the address.
+template <class Backend>
+struct BackendTraits;
+
+#ifdef ENABLE_ZK
+template <>
+struct BackendTraits<ZKClient>
+{
+    static constexpr const char *PROTOCOL = "zk";
+    static constexpr bool TAKES_URL = true;
+};
+#endif
+
+#ifdef ENABLE_CONSUL
+template <>
+struct BackendTraits<ConsulClient>
+{
+    static constexpr const char *PROTOCOL = "consul";
+    static constexpr bool TAKES_URL = false;
+};
+#endif
+
+#ifdef ENABLE_ETCD
+template <>
+struct BackendTraits<ETCDClient>
+{
+    static constexpr const char *PROTOCOL = "etcd";
+    static constexpr bool TAKES_URL = false;
+};
+#endif
+
+template <class Backend>
+std::string backend_address(std::string url)
+{
+    auto [protocol, address] = split_url(url);
+    if (protocol != BackendTraits<Backend>::PROTOCOL)
+        throw InvalidAddress("protocol not supported by this client: " + protocol);
+    return BackendTraits<Backend>::TAKES_URL ? std::move(url) : std::move(address);
+}
+
+} // namespace detail
+
+// The client of a backend known at compile time. It is final, so calls made on it rather
+// than on Client& are not virtual and can be inlined into the caller; it is still a Client
+// where one is expected.
+template <class Backend>
+class BasicClient final : public Backend
+{
+public:
+    explicit BasicClient(std::string url, Path prefix = "")
+        : Backend(detail::backend_address<Backend>(std::move(url)), std::move(prefix))
+    {}
+};
+
+#ifdef ENABLE_ZK
+using zk_client = BasicClient<ZKClient>;
+#endif
+
+#ifdef ENABLE_CONSUL
+using consul_client = BasicClient<ConsulClient>;
+#endif
+
+#ifdef ENABLE_ETCD
+using etcd_client = BasicClient<ETCDClient>;
+#endif
+
 } // namespace liboffkv
@@ -5,6 +5,8 @@
 #include <chrono>
 #include <thread>
 
+#include "client.hpp"
+
 namespace liboffkv::detail {
 
 class PingControl
@@ -54,7 +56,7 @@ public:
         : ctl_{new PingControl{}}
     {
         try {
-            std::thread([ctl = ctl_, first_timeout, callback = std::forward<Callback>(callback)]() {
+            std::thread([ctl = ctl_, first_timeout, callback = std::forward<Callback>(callback)]() mutable {
                 auto timeout = first_timeout;
                 while (!ctl->wait(timeout))
                     timeout = callback();
@@ -89,4 +91,39 @@ public:
     ~PingSender() { destroy_(); }
 };
 
+// Passes lease status reports on to the handler set by the user, if they are worth a warning.
+class LeaseMonitor
+{
+    std::mutex mtx_;
+    std::chrono::milliseconds min_margin_;
+    LeaseWarningHandler handler_;
+
+public:
+    LeaseMonitor()
+        : mtx_{}
+        , min_margin_{0}
+        , handler_{}
+    {}
+
+    void set_handler(std::chrono::milliseconds min_margin, LeaseWarningHandler handler)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        min_margin_ = min_margin;
+        handler_ = std::move(handler);
+    }
+
+    void report(const LeaseStatus &status)
+    {
+        LeaseWarningHandler handler;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (!handler_ || (!status.lost && status.margin >= min_margin_))
+                return;
+            handler = handler_;
+        }
+        // called without the lock, so the handler may replace itself
+        handler(status);
+    }
+};
+
 } // namespace liboffkv
@@ -4,7 +4,16 @@
 #include <utility>
 #include <vector>
 #include <set>
+#include <map>
 #include <type_traits>
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+#include <chrono>
+#include <mutex>
+#include <functional>
+#include "client.hpp"
+#include "errors.hpp"
 
 namespace liboffkv::detail {
 
@@ -23,6 +32,150 @@ std::pair<std::string, std::string> split_url(const std::string &url)
     return {url.substr(0, pos), url.substr(pos + DELIM.size())};
 }
 
+// "address?a=1&b=2" -> {"address", {{"a", "1"}, {"b", "2"}}}
+inline std::pair<std::string, std::map<std::string, std::string>> split_query(const std::string &address)
+{
+    const auto pos = address.find('?');
+    if (pos == std::string::npos)
+        return {address, {}};
+
+    std::map<std::string, std::string> params;
+    size_t begin = pos + 1;
+    while (begin <= address.size()) {
+        const auto end = std::min(address.find('&', begin), address.size());
+        const auto eq = address.find('=', begin);
+        if (eq == std::string::npos || eq > end)
+            throw InvalidAddress("URL parameter must be of 'name=value' format");
+
+        params[address.substr(begin, eq - begin)] = address.substr(eq + 1, end - eq - 1);
+        begin = end + 1;
+    }
+
+    return {address.substr(0, pos), std::move(params)};
+}
+
+// Reads a positive integer parameter not greater than max_value, returns default_value if it is not set.
+inline size_t get_count_param(const std::map<std::string, std::string> &params,
+                              const std::string &name, size_t default_value,
+                              size_t max_value = SIZE_MAX)
+{
+    const auto it = params.find(name);
+    if (it == params.end())
+        return default_value;
+
+    const auto &value = it->second;
+    size_t parsed = 0;
+    if (!value.empty() && std::all_of(value.begin(), value.end(), [](char c) { return '0' <= c && c <= '9'; })) {
+        try {
+            parsed = std::stoul(value);
+        } catch (std::out_of_range&) {}
+    }
+
+    if (!parsed)
+        throw InvalidAddress("URL parameter '" + name + "' must be a positive integer");
+    if (parsed > max_value)
+        throw InvalidAddress("URL parameter '" + name + "' must not exceed " + std::to_string(max_value));
+    return parsed;
+}
+
+// Reads a "true"/"false" (or "1"/"0") parameter, returns default_value if it is not set.
+inline bool get_bool_param(const std::map<std::string, std::string> &params,
+                           const std::string &name, bool default_value)
+{
+    const auto it = params.find(name);
+    if (it == params.end())
+        return default_value;
+
+    if (it->second == "true" || it->second == "1")
+        return true;
+    if (it->second == "false" || it->second == "0")
+        return false;
+    throw InvalidAddress("URL parameter '" + name + "' must be true or false");
+}
+
+// Shares expiring leases (or sessions) between keys that expire at about the same time, so that
+// their number stays bounded: a key gets a lease granted for no less than its TTL and at most
+// max(1s, TTL/16) more. When the lease actually expires is up to the backend.
+template<class Id>
+class ExpiryPool
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::mutex mtx_;
+    std::map<Clock::time_point, Id> pool_;
+
+public:
+    // grant(ttl) creates a new lease that expires in ttl
+    template<class Grant>
+    Id get(std::chrono::seconds ttl, Grant &&grant)
+    {
+        const auto now = Clock::now();
+        const auto granularity = std::max(std::chrono::seconds(1), ttl / 16);
+        const auto buckets = (now + ttl - Clock::time_point{} + granularity - Clock::duration(1)) / granularity;
+        const auto expires_at = Clock::time_point{} + buckets * granularity;
+
+        std::lock_guard<std::mutex> lock(mtx_);
+        pool_.erase(pool_.begin(), pool_.upper_bound(now));
+
+        auto it = pool_.find(expires_at);
+        if (it == pool_.end()) {
+            const auto lease_ttl = std::chrono::ceil<std::chrono::seconds>(expires_at - now);
+            it = pool_.emplace(expires_at, grant(lease_ttl)).first;
+        }
+        return it->second;
+    }
+};
+
+// Zero-pads the counter of a sequential child so that names sort in creation order.
+inline std::string sequential_name(uint64_t counter, size_t width)
+{
+    auto digits = std::to_string(counter);
+    return digits.size() < width ? std::string(width - digits.size(), '0') + digits : digits;
+}
+
+// Applies the query to the full list of children, sorting only the part that is kept.
+inline void apply_children_query(std::vector<std::string> &children, const ChildrenQuery &query)
+{
+    const size_t n = query.limit && query.limit < children.size() ? query.limit : children.size();
+    switch (query.order) {
+    case ChildrenQuery::Order::NONE:
+        break;
+    case ChildrenQuery::Order::ASCEND:
+        std::partial_sort(children.begin(), children.begin() + n, children.end());
+        break;
+    case ChildrenQuery::Order::DESCEND:
+        std::partial_sort(children.begin(), children.begin() + n, children.end(), std::greater<>());
+        break;
+    }
+    children.resize(n);
+}
+
+// Adds a change to the delta, cancelling out a child that was added and removed in between
+// (or removed and added back), so that the delta is the same as diff_children gives.
+inline void add_child_change(ChildrenDelta &delta, std::string child, bool removed)
+{
+    auto &opposite = removed ? delta.added : delta.removed;
+    auto it = std::find(opposite.begin(), opposite.end(), child);
+    if (it != opposite.end())
+        opposite.erase(it);
+    else
+        (removed ? delta.removed : delta.added).push_back(std::move(child));
+}
+
+// Compares two sorted lists of children.
+inline ChildrenDelta diff_children(const std::vector<std::string> &old_children,
+                                   const std::vector<std::string> &new_children)
+{
+    ChildrenDelta delta;
+    std::set_difference(new_children.begin(), new_children.end(),
+                        old_children.begin(), old_children.end(),
+                        std::back_inserter(delta.added));
+    std::set_difference(old_children.begin(), old_children.end(),
+                        new_children.begin(), new_children.end(),
+                        std::back_inserter(delta.removed));
+    return delta;
+}
+
 template<class T>
 bool equal_as_unordered(const std::vector<T> &a, const std::vector<T> &b)
 {
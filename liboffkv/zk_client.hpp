@@ -5,9 +5,18 @@
 #include <zk/multi.hpp>
 #include <zk/types.hpp>
 
+#include <map>
+#include <sstream>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
 
 #include "client.hpp"
 #include "key.hpp"
+#include "util.hpp"
 
 
 
@@ -58,9 +67,32 @@ private:
         }
     }
 
-    std::string as_path_string_(const Path &path) const
+    // the prefix is applied by the server as the session chroot, see with_chroot_
+    static std::string as_path_string_(const Path &path)
     {
-        return static_cast<std::string>(prefix_ / path);
+        return static_cast<std::string>(path);
+    }
+
+    static std::string child_key_(const std::string& path, const std::string& child)
+    {
+        std::string result;
+        result.reserve(path.size() + child.size() + 1);
+        return result.append(path).append("/").append(child);
+    }
+
+    // "zk://host:port[/chroot][?params]" -> "zk://host:port[/chroot]/prefix[?params]"
+    static std::string with_chroot_(const std::string& url, const Path& prefix)
+    {
+        auto path_end = std::min(url.find('?'), url.size());
+
+        // "zk://host:port/chroot/" must not turn into ".../chroot//prefix"
+        auto authority = url.find("://");
+        auto authority_end = authority == std::string::npos ? 0 : authority + 3;
+        auto chroot_end = path_end;
+        while (chroot_end > authority_end && url[chroot_end - 1] == '/')
+            --chroot_end;
+
+        return url.substr(0, chroot_end) + static_cast<std::string>(prefix) + url.substr(path_end);
     }
 
     [[noreturn]] static void rethrow_(zk::error& e)
@@ -81,6 +113,8 @@ private:
         }
     }
 
+    // zkpp has no way to remove a watch: a dropped handle's watch stays registered
+    // on the server until it fires once, which is all a ZooKeeper watch can do anyway
     class ZKWatchHandle_ : public WatchHandle {
     private:
         std::future<zk::event> event_;
@@ -100,32 +134,303 @@ private:
         }
     };
 
+    class ZKValueWatchHandle_ : public ValueWatchHandle {
+    private:
+        zk::client client_;
+        std::string path_;
+        std::future<zk::event> event_;
+
+    public:
+        ZKValueWatchHandle_(zk::client client, std::string path, std::future<zk::event>&& event)
+            : client_(std::move(client)), path_(std::move(path)), event_(std::move(event))
+        {}
+
+        WatchedValue wait() override
+        {
+            try {
+                if (event_.get().type() == zk::event_type::erased)
+                    return {0, {}};
+
+                // ZooKeeper events carry no data, so the new value has to be fetched
+                auto result = client_.get(path_).get();
+                return {
+                    static_cast<int64_t>(result.stat().data_version.value) + 1,
+                    to_string_(result.data())
+                };
+            } catch (zk::no_entry&) {
+                return {0, {}};
+            } catch (zk::error& e) {
+                rethrow_(e);
+            }
+        }
+    };
+
+    // ZooKeeper only tells that the children have changed, so the handle keeps
+    // the last listing to compute the delta
+    class ZKChildrenWatchHandle_ : public ChildrenWatchHandle {
+    private:
+        zk::client client_;
+        std::string path_;
+        std::vector<std::string> children_;
+        std::future<zk::event> event_;
+        bool erased_ = false;
+
+    public:
+        ZKChildrenWatchHandle_(zk::client client, std::string path,
+                               std::vector<std::string> children, std::future<zk::event>&& event)
+            : client_(std::move(client)), path_(std::move(path)),
+              children_(std::move(children)), event_(std::move(event))
+        {
+            std::sort(children_.begin(), children_.end());
+        }
+
+        ChildrenDelta wait() override
+        {
+            if (erased_) throw NoEntry{};
+
+            try {
+                while (true) {
+                    event_.get();
+
+                    std::vector<std::string> children;
+                    try {
+                        auto result = client_.watch_children(path_).get();
+                        event_ = std::move(result.next());
+                        children = std::move(result.initial().children());
+                    } catch (zk::no_entry&) {
+                        // the parent is erased, so are all its children
+                        erased_ = true;
+                    }
+                    std::sort(children.begin(), children.end());
+
+                    auto delta = detail::diff_children(children_, children);
+                    children_ = std::move(children);
+
+                    if (!delta.empty()) {
+                        for (auto& child : delta.added) child = child_key_(path_, child);
+                        for (auto& child : delta.removed) child = child_key_(path_, child);
+                        return delta;
+                    }
+                    if (erased_) throw NoEntry{};
+                }
+            } catch (zk::error& e) {
+                rethrow_(e);
+            }
+        }
+    };
+
+    // zkpp has no persistent recursive watches (addWatch of ZooKeeper 3.6), so the handle
+    // keeps a data and a children watch on every node of the subtree. zkpp futures have no
+    // continuations either, so a single waiter thread of the handle checks the pending watches,
+    // sleeping in between unless a watch is added, and queues the fired ones for wait()
+    class ZKSubtreeWatchHandle_ : public SubtreeWatchHandle {
+    private:
+        static constexpr auto POLL_INTERVAL = std::chrono::milliseconds(10);
+
+        struct Watch_ {
+            std::future<zk::event> event;
+            // tells the current watch of the node from the ones it replaced
+            uint64_t id;
+            std::string path;
+            bool children;
+        };
+
+        zk::client client_;
+        // the watches of the nodes by path, by id
+        std::map<std::string, uint64_t> data_watches_;
+        std::map<std::string, uint64_t> children_watches_;
+        uint64_t next_id_ = 0;
+
+        std::mutex lock_;
+        std::condition_variable waiter_cv_;
+        std::condition_variable fired_cv_;
+        std::vector<Watch_> pending_;
+        std::vector<Watch_> fired_;
+        bool stopping_ = false;
+        std::thread waiter_;
+
+        void wait_pending_()
+        {
+            std::unique_lock lock(lock_);
+            while (!stopping_) {
+                auto first_fired = std::partition(pending_.begin(), pending_.end(), [](auto& watch) {
+                    return watch.event.wait_for(std::chrono::seconds::zero()) != std::future_status::ready;
+                });
+                if (first_fired != pending_.end()) {
+                    std::move(first_fired, pending_.end(), std::back_inserter(fired_));
+                    pending_.erase(first_fired, pending_.end());
+                    fired_cv_.notify_one();
+                }
+                waiter_cv_.wait_for(lock, POLL_INTERVAL);
+            }
+        }
+
+        uint64_t arm_(std::future<zk::event>&& event, const std::string& path, bool children)
+        {
+            const auto id = next_id_++;
+            {
+                std::lock_guard lock(lock_);
+                pending_.push_back({std::move(event), id, path, children});
+            }
+            waiter_cv_.notify_one();
+            return id;
+        }
+
+        // returns the version of the node or 0 if it does not exist
+        int64_t watch_data_(const std::string& path)
+        {
+            try {
+                auto result = client_.watch(path).get();
+                data_watches_[path] = arm_(std::move(result.next()), path, false);
+                return static_cast<int64_t>(result.initial().stat().data_version.value) + 1;
+            } catch (zk::no_entry&) {
+                data_watches_.erase(path);
+                return 0;
+            }
+        }
+
+        // watches the children of the node, recursively watching the ones not seen yet
+        void watch_children_(const std::string& path, std::vector<SubtreeChange>& created)
+        {
+            std::vector<std::string> children;
+            try {
+                auto result = client_.watch_children(path).get();
+                children_watches_[path] = arm_(std::move(result.next()), path, true);
+                children = std::move(result.initial().children());
+            } catch (zk::no_entry&) {
+                children_watches_.erase(path);
+                return;
+            }
+
+            for (const auto& child : children) {
+                auto child_path = child_key_(path, child);
+                if (data_watches_.count(child_path))
+                    continue;
+                if (auto version = watch_data_(child_path)) {
+                    created.push_back({child_path, version});
+                    watch_children_(child_path, created);
+                }
+            }
+        }
+
+        std::vector<Watch_> wait_fired_()
+        {
+            std::unique_lock lock(lock_);
+            fired_cv_.wait(lock, [this] { return !fired_.empty(); });
+            return std::exchange(fired_, {});
+        }
+
+    public:
+        ZKSubtreeWatchHandle_(zk::client client, const std::string& path)
+            : client_(std::move(client))
+        {
+            std::vector<SubtreeChange> existing;
+            watch_children_(path, existing);
+            if (children_watches_.empty()) throw NoEntry{};
+            waiter_ = std::thread([this] { wait_pending_(); });
+        }
+
+        ~ZKSubtreeWatchHandle_() override
+        {
+            {
+                std::lock_guard lock(lock_);
+                stopping_ = true;
+            }
+            waiter_cv_.notify_one();
+            waiter_.join();
+        }
+
+        std::vector<SubtreeChange> wait() override
+        {
+            try {
+                while (true) {
+                    if (children_watches_.empty()) throw NoEntry{};
+
+                    std::vector<SubtreeChange> changes;
+
+                    for (auto& fired : wait_fired_()) {
+                        auto& watches = fired.children ? children_watches_ : data_watches_;
+                        auto it = watches.find(fired.path);
+                        // the node has been erased and its watch dropped meanwhile
+                        if (it == watches.end() || it->second != fired.id)
+                            continue;
+
+                        auto type = fired.event.get().type();
+                        watches.erase(it);
+                        if (fired.children)
+                            watch_children_(fired.path, changes);
+                        else
+                            changes.push_back({fired.path, type == zk::event_type::erased ? 0 : watch_data_(fired.path)});
+                    }
+
+                    if (!changes.empty()) return changes;
+                }
+            } catch (zk::error& e) {
+                rethrow_(e);
+            }
+        }
+    };
+
     std::unique_ptr<WatchHandle> make_watch_handle_(std::future<zk::event>&& event) const
     {
         return std::make_unique<ZKWatchHandle_>(std::move(event));
     }
 
-public:
-    ZKClient(const std::string& address, Path prefix) try
-        : Client(std::move(prefix)), client_(zk::client::connect(address).get())
+    // ZooKeeper does not create the chroot node itself, so it is created (if needed)
+    // through a temporary connection which is not chrooted
+    void ensure_prefix_exists_(const std::string& url)
     {
+        // "/" is the prefix node from the chrooted session's point of view
+        if (prefix_.root() || client_.exists("/").get())
+            return;
+
+        std::vector<std::string> entries;
         std::string entry;
-        entry.reserve(prefix_.size());
-        for (const auto& segment : prefix_.segments()) {
+        for (const auto& segment : prefix_.segments())
+            entries.push_back(entry.append("/").append(segment));
+
+        auto root_client = zk::client::connect(url).get();
+
+        // closes the session however we leave this function
+        struct ClientCloser_ {
+            zk::client& client;
+            ~ClientCloser_() { client.close(); }
+        } closer{root_client};
+
+        // all the missing segments are created in one multi op;
+        // if some of them already exist, the failed op tells how many to skip
+        for (size_t first = 0; first < entries.size();) {
+            zk::multi_op txn;
+            for (size_t i = first; i < entries.size(); ++i)
+                txn.push_back(zk::op::create(entries[i], buffer()));
+
             try {
-                client_.create(entry.append("/").append(segment), buffer()).get();
-            } catch (zk::entry_exists&) {
-                // do nothing
-            } catch (zk::error& e) {
-                rethrow_(e);
+                root_client.commit(txn).get();
+                break;
+            } catch (zk::transaction_failed& e) {
+                if (e.underlying_cause() != zk::error_code::entry_exists)
+                    rethrow_(e);
+                first += e.failed_op_index() + 1;
             }
         }
+    }
+
+public:
+    // TODO: resume the session persisted by a previous process once zkpp exposes the session id
+    // and password and accepts them on connect; until then each client starts a new session and
+    // its ephemeral nodes are lost on restart (see "Known limitations" in the README)
+    ZKClient(const std::string& address, Path prefix) try
+        : Client(std::move(prefix)), client_(zk::client::connect(with_chroot_(address, prefix_)).get())
+    {
+        ensure_prefix_exists_(address);
     } catch (zk::error& e) {
         rethrow_(e);
     }
 
 
-    int64_t create(const Key& key, const std::string& value, bool lease = false) override
+    // ephemeral nodes live as long as the session, so the lease TTL is not used: failure
+    // detection is set for the whole client with the session timeout in the connection string
+    int64_t create(const Key& key, const std::string& value, Lease lease = {}) override
     {
         try {
             client_.create(
@@ -139,6 +444,27 @@ public:
         return 1;
     }
 
+    // the server appends its 10-digit counter of the parent to "parent/"
+    std::string create_sequential(const Key& parent, const std::string& value, Lease lease = {}) override
+    {
+        try {
+            auto name = client_.create(
+                child_key_(as_path_string_(parent), ""),
+                from_string_(value),
+                !lease ? zk::create_mode::sequential : zk::create_mode::sequential | zk::create_mode::ephemeral
+            ).get().name();
+            return name.substr(name.rfind('/') + 1);
+        } catch (zk::error& e) {
+            rethrow_(e);
+        }
+    }
+
+    // ZooKeeper has TTL nodes since 3.5.3, but zkpp has no create mode for them
+    int64_t create(const Key&, const std::string&, std::chrono::seconds) override
+    {
+        throw ServiceError("keys with a TTL are not supported by the ZooKeeper client library");
+    }
+
 
     ExistsResult exists(const Key& key, bool watch = false) override
     {
@@ -163,15 +489,16 @@ public:
 
     ChildrenResult get_children(const Key& key, bool watch) override
     {
+        const auto path = as_path_string_(key);
         std::vector<std::string> raw_children;
         std::unique_ptr<WatchHandle> watch_handle;
         try {
             if (watch) {
-                auto result = client_.watch_children(as_path_string_(key)).get();
+                auto result = client_.watch_children(path).get();
                 watch_handle = make_watch_handle_(std::move(result.next()));
                 raw_children = std::move(result.initial().children());
             } else {
-                auto result = client_.get_children(as_path_string_(key)).get();
+                auto result = client_.get_children(path).get();
                 raw_children = std::move(result.children());
             }
         } catch (zk::error& e) {
@@ -179,15 +506,157 @@ public:
         }
 
         std::vector<std::string> children;
-        for (const auto& child : raw_children) {
-            children.emplace_back();
-            children.back().reserve(key.size() + child.size() + 1);
-            children.back().append(static_cast<std::string>(key)).append("/").append(child);
-        }
+        children.reserve(raw_children.size());
+        for (const auto& child : raw_children)
+            children.push_back(child_key_(path, child));
         return { std::move(children), std::move(watch_handle) };
     }
 
 
+    PmrChildren get_children(const Key& key, std::pmr::memory_resource* resource) override
+    {
+        const auto path = as_path_string_(key);
+        try {
+            auto result = client_.get_children(path).get();
+
+            PmrChildren children(resource);
+            children.reserve(result.children().size());
+            for (const auto& child : result.children()) {
+                auto& child_key = children.emplace_back();
+                child_key.reserve(path.size() + child.size() + 1);
+                child_key.append(path).append("/").append(child);
+            }
+            return children;
+        } catch (zk::error& e) {
+            rethrow_(e);
+        }
+    }
+
+
+    StatResult stat(const Key& key) override
+    {
+        std::optional<zk::stat> stat;
+        try {
+            stat = client_.exists(as_path_string_(key)).get().stat();
+        } catch (zk::error& e) {
+            rethrow_(e);
+        }
+
+        if (!stat) throw NoEntry{};
+
+        std::ostringstream owner;
+        if (stat->ephemeral_owner) owner << std::hex << "0x" << stat->ephemeral_owner;
+
+        return {
+            static_cast<int64_t>(stat->data_version.value) + 1,
+            stat->create_transaction.value,
+            stat->modified_transaction.value,
+            stat->data_size,
+            stat->children_count,
+            owner.str()
+        };
+    }
+
+    size_t count_children(const Key& key) override
+    {
+        std::optional<zk::stat> stat;
+        try {
+            stat = client_.exists(as_path_string_(key)).get().stat();
+        } catch (zk::error& e) {
+            rethrow_(e);
+        }
+
+        if (!stat) throw NoEntry{};
+        return stat->children_count;
+    }
+
+    // zkpp has no getAllChildrenNumber, so the subtree is walked level by level
+    // with all the requests of a level in flight at once
+    size_t count_subtree(const Key& key) override
+    {
+        size_t count = 0;
+        std::vector<std::string> level{as_path_string_(key)};
+        try {
+            for (bool root = true; !level.empty(); root = false) {
+                std::vector<std::future<zk::get_children_result>> results;
+                results.reserve(level.size());
+                for (const auto& path : level)
+                    results.push_back(client_.get_children(path));
+
+                std::vector<std::string> next_level;
+                for (size_t i = 0; i < level.size(); ++i) {
+                    try {
+                        auto result = results[i].get();
+                        count += result.children().size();
+                        for (const auto& child : result.children())
+                            next_level.push_back(child_key_(level[i], child));
+                    } catch (zk::error& e) {
+                        // a descendant erased meanwhile has no descendants left
+                        if (root || e.code() != zk::error_code::no_entry) throw;
+                    }
+                }
+                level = std::move(next_level);
+            }
+        } catch (zk::error& e) {
+            rethrow_(e);
+        }
+        return count;
+    }
+
+    // ZooKeeper can only list all the children, but only the kept ones are turned into keys
+    std::vector<std::string> get_children(const Key& key, const ChildrenQuery& query) override
+    {
+        const auto path = as_path_string_(key);
+        std::vector<std::string> raw_children;
+        try {
+            raw_children = std::move(client_.get_children(path).get().children());
+        } catch (zk::error& e) {
+            rethrow_(e);
+        }
+
+        detail::apply_children_query(raw_children, query);
+
+        std::vector<std::string> children;
+        children.reserve(raw_children.size());
+        for (const auto& child : raw_children)
+            children.push_back(child_key_(path, child));
+        return children;
+    }
+
+
+    ChildrenWatchResult watch_children(const Key& key) override
+    {
+        const auto path = as_path_string_(key);
+        try {
+            auto result = client_.watch_children(path).get();
+            auto raw_children = result.initial().children();
+
+            std::vector<std::string> children;
+            children.reserve(raw_children.size());
+            for (const auto& child : raw_children)
+                children.push_back(child_key_(path, child));
+
+            return {
+                std::move(children),
+                std::make_unique<ZKChildrenWatchHandle_>(client_, path, std::move(raw_children),
+                                                         std::move(result.next()))
+            };
+        } catch (zk::error& e) {
+            rethrow_(e);
+        }
+    }
+
+
+    std::unique_ptr<SubtreeWatchHandle> watch_subtree(const Key& key) override
+    {
+        try {
+            return std::make_unique<ZKSubtreeWatchHandle_>(client_, as_path_string_(key));
+        } catch (zk::error& e) {
+            rethrow_(e);
+        }
+    }
+
+
     // No transactions. Atomicity is not necessary for linearizability here!
     // At least it seems to be so...
     // See also TLA+ spec: https://gist.github.com/raid-7/9ad7b88cd2ec2e83f56e3b69214b6762
@@ -216,30 +685,37 @@ public:
     // Same as set: transactions aren't necessary
     CasResult cas(const Key& key, const std::string& value, int64_t version = 0) override
     {
+        const auto path = as_path_string_(key);
+
+        // the current value is only read once the cas has failed, so that a successful one
+        // does not pay for it; it may have changed again by then
         if (!version) {
             try {
                 return {create(key, value)};
-            } catch (EntryExists&) {
-                return {0};
+            } catch (EntryExists&) {}
+        } else {
+            try {
+                auto set_result = client_.set(path, from_string_(value), zk::version(version - 1)).get();
+                return {static_cast<int64_t>(set_result.stat().data_version.value) + 1};
+            } catch (zk::error& e) {
+                switch (e.code()) {
+                    case zk::error_code::no_entry:
+                        throw NoEntry{};
+                    case zk::error_code::version_mismatch:
+                        break;
+                    default:
+                        rethrow_(e);
+                }
             }
         }
 
         try {
-            return {static_cast<int64_t>(
-                        client_.set(
-                            as_path_string_(key),
-                            from_string_(value),
-                            zk::version(version - 1)
-                        ).get().stat().data_version.value) + 1};
+            auto result = client_.get(path).get();
+            return {0, static_cast<int64_t>(result.stat().data_version.value) + 1, to_string_(result.data())};
+        } catch (zk::no_entry&) {
+            return {0};
         } catch (zk::error& e) {
-            switch (e.code()) {
-                case zk::error_code::no_entry:
-                    throw NoEntry{};
-                case zk::error_code::version_mismatch:
-                    return {0};
-                default:
-                    rethrow_(e);
-            }
+            rethrow_(e);
         }
     }
 
@@ -268,6 +744,55 @@ public:
     }
 
 
+    PmrGetResult get(const Key& key, std::pmr::memory_resource* resource) override
+    {
+        try {
+            auto result = client_.get(as_path_string_(key)).get();
+            const auto& data = result.data();
+            return {
+                static_cast<int64_t>(result.stat().data_version.value) + 1,
+                std::pmr::string(data.begin(), data.end(), resource)
+            };
+        } catch (zk::error& e) {
+            rethrow_(e);
+        }
+    }
+
+
+    // the stat is read first, the value only if it has changed
+    GetIfChangedResult get_if_changed(const Key& key, int64_t known_version) override
+    {
+        auto path = as_path_string_(key);
+        try {
+            auto stat = client_.exists(path).get().stat();
+            if (!stat) throw NoEntry{};
+            if (static_cast<int64_t>(stat->data_version.value) + 1 == known_version) return {known_version, std::nullopt};
+
+            auto result = client_.get(path).get();
+            return {static_cast<int64_t>(result.stat().data_version.value) + 1, to_string_(result.data())};
+        } catch (zk::error& e) {
+            rethrow_(e);
+        }
+    }
+
+
+    ValueWatchResult watch_value(const Key& key) override
+    {
+        auto path = as_path_string_(key);
+        try {
+            auto watch_result = client_.watch(path).get();
+            const auto& initial = watch_result.initial();
+            return {
+                static_cast<int64_t>(initial.stat().data_version.value) + 1,
+                to_string_(initial.data()),
+                std::make_unique<ZKValueWatchHandle_>(client_, path, std::move(watch_result.next()))
+            };
+        } catch (zk::error& e) {
+            rethrow_(e);
+        }
+    }
+
+
     void erase(const Key& key, int64_t version = 0) override
     {
         auto path = as_path_string_(key);
@@ -296,20 +821,108 @@ public:
     }
 
 
+    using Client::commit;
+
+    // the latest op before the given one that writes the key: a create or a set, or an erase
+    // of the key or of one of its ancestors; nullptr if there is none
+    static const TxnOp* written_before_(const Transaction& transaction, size_t index, const Key& key)
+    {
+        const auto path = static_cast<std::string>(key);
+        for (size_t j = index; j-- > 0;) {
+            const auto& op = transaction.ops[j];
+            if (auto create = std::get_if<TxnOpCreate>(&op); create && static_cast<std::string>(create->key) == path)
+                return &op;
+            if (auto set = std::get_if<TxnOpSet>(&op); set && static_cast<std::string>(set->key) == path)
+                return &op;
+            if (auto erase = std::get_if<TxnOpErase>(&op)) {
+                const auto erased = static_cast<std::string>(erase->key);
+                if (path.compare(0, erased.size(), erased) == 0 &&
+                        (path.size() == erased.size() || path[erased.size()] == '/'))
+                    return &op;
+            }
+        }
+        return nullptr;
+    }
+
+    // ZooKeeper multi can neither read nor compare values, so reads and value checks are done
+    // right before the commit and pinned by a check of the data version of the read key; if it
+    // has changed, the whole transaction is repeated (at most MAX_COMMIT_ATTEMPTS times). A key
+    // written by an earlier op of the same transaction is not pinned, its value after the write
+    // is returned instead. The check cannot cover the list of children (only the data version
+    // of the parent), so TxnOpGetChildren is not atomic with the rest of the transaction.
     TransactionResult commit(const Transaction& transaction) override
     {
-        while (true) {
-            std::vector<size_t> boundaries;
+        static constexpr size_t MAX_COMMIT_ATTEMPTS = 100;
+
+        for (size_t attempt = 0; attempt < MAX_COMMIT_ATTEMPTS; ++attempt) {
+            // the end of the ops of each check and op in the multi; a check or op may have none
+            std::vector<size_t> ends;
             zk::multi_op txn;
 
-            for (const auto& check : transaction.checks) {
-                txn.push_back(zk::op::check(as_path_string_(check.key),
-                                            check.version ? zk::version(check.version - 1) : zk::version::any()));
-                boundaries.emplace_back(txn.size() - 1);
+            // issue all the reads at once not to wait for them one by one
+            std::map<size_t, zk::future<zk::get_result>> check_reads;
+            for (size_t i = 0; i < transaction.checks.size(); ++i)
+                if (transaction.checks[i].kind != TxnCheck::Kind::VERSION)
+                    check_reads.emplace(i, client_.get(as_path_string_(transaction.checks[i].key)));
+
+            // the reads of the keys written earlier in the transaction, by op index, with the write
+            std::map<size_t, const TxnOp*> derived_reads;
+            std::map<size_t, zk::future<zk::get_result>> value_reads;
+            std::map<size_t, zk::future<zk::get_children_result>> children_reads;
+            for (size_t i = 0; i < transaction.ops.size(); ++i) {
+                if (auto get = std::get_if<TxnOpGet>(&transaction.ops[i])) {
+                    if (auto write = written_before_(transaction, i, get->key)) {
+                        if (std::holds_alternative<TxnOpErase>(*write))
+                            throw TxnFailed{transaction.checks.size() + i};
+                        derived_reads.emplace(i, write);
+                    } else {
+                        value_reads.emplace(i, client_.get(as_path_string_(get->key)));
+                    }
+                } else if (auto get_children = std::get_if<TxnOpGetChildren>(&transaction.ops[i])) {
+                    auto write = written_before_(transaction, i, get_children->key);
+                    if (write && std::holds_alternative<TxnOpErase>(*write))
+                        throw TxnFailed{transaction.checks.size() + i};
+                    if (write)
+                        derived_reads.emplace(i, write);
+                    children_reads.emplace(i, client_.get_children(as_path_string_(get_children->key)));
+                }
+            }
+
+            // the results of the reads by op index
+            std::map<size_t, TxnOpResult> reads;
+
+            for (size_t i = 0; i < transaction.checks.size(); ++i) {
+                const auto& check = transaction.checks[i];
+                const auto path = as_path_string_(check.key);
+                if (check.kind == TxnCheck::Kind::ABSENT) {
+                    // the multi cannot check that a node does not exist, so this is only a lookup
+                    try {
+                        check_reads.at(i).get();
+                        throw TxnFailed{i};
+                    } catch (zk::no_entry&) {
+                    } catch (zk::error& e) {
+                        rethrow_(e);
+                    }
+                } else if (check.kind != TxnCheck::Kind::VERSION) {
+                    try {
+                        auto result = check_reads.at(i).get();
+                        if (!check.matches(to_string_(result.data()))) throw TxnFailed{i};
+                        txn.push_back(zk::op::check(path, result.stat().data_version));
+                    } catch (zk::no_entry&) {
+                        throw TxnFailed{i};
+                    } catch (zk::error& e) {
+                        rethrow_(e);
+                    }
+                } else {
+                    txn.push_back(zk::op::check(path,
+                                                check.version ? zk::version(check.version - 1) : zk::version::any()));
+                }
+                ends.push_back(txn.size());
             }
 
-            for (const auto& op : transaction.ops) {
-                std::visit([&txn, this](auto&& arg) {
+            for (size_t i = 0; i < transaction.ops.size(); ++i) {
+                std::visit([&transaction, &txn, &derived_reads, &value_reads, &children_reads, &reads,
+                            i, this](auto&& arg) {
                     using T = std::decay_t<decltype(arg)>;
                     if constexpr (std::is_same_v<T, TxnOpCreate>) {
                         txn.push_back(zk::op::create(
@@ -322,10 +935,44 @@ public:
                                                   from_string_(arg.value)));
                     } else if constexpr (std::is_same_v<T, TxnOpErase>) {
                         make_recursive_erase_query_(txn, as_path_string_(arg.key), FAIL_TXN_ON_NO_ENTRY);
+                    } else if constexpr (std::is_same_v<T, TxnOpGet> || std::is_same_v<T, TxnOpGetChildren>) {
+                        const auto path = as_path_string_(arg.key);
+                        const bool derived = derived_reads.count(i);
+                        try {
+                            if constexpr (std::is_same_v<T, TxnOpGet>) {
+                                // the version is filled in from the result of the write
+                                if (derived) return;
+                                auto result = value_reads.at(i).get();
+                                reads[i] = TxnOpResult{
+                                    TxnOpResult::Kind::GET,
+                                    static_cast<int64_t>(result.stat().data_version.value) + 1,
+                                    to_string_(result.data())
+                                };
+                                txn.push_back(zk::op::check(path, result.stat().data_version));
+                            } else {
+                                auto result = children_reads.at(i).get();
+                                std::vector<std::string> children;
+                                children.reserve(result.children().size());
+                                for (const auto& child : result.children())
+                                    children.push_back(child_key_(path, child));
+                                reads[i] = TxnOpResult{TxnOpResult::Kind::GET_CHILDREN, 0, {}, std::move(children)};
+                                if (!derived)
+                                    txn.push_back(zk::op::check(path, result.parent_stat().data_version));
+                            }
+                        } catch (zk::no_entry&) {
+                            // a key created earlier in the transaction has no children yet
+                            if (derived && std::holds_alternative<TxnOpCreate>(*derived_reads.at(i))) {
+                                reads[i] = TxnOpResult{TxnOpResult::Kind::GET_CHILDREN};
+                                return;
+                            }
+                            throw TxnFailed{transaction.checks.size() + i};
+                        } catch (zk::error& e) {
+                            rethrow_(e);
+                        }
                     } else static_assert(detail::always_false<T>::value, "non-exhaustive visitor");
-                }, op);
+                }, transaction.ops[i]);
 
-                boundaries.push_back(txn.size() - 1);
+                ends.push_back(txn.size());
             }
 
             std::optional<zk::multi_result> raw_result;
@@ -334,40 +981,84 @@ public:
                 raw_result.emplace(client_.commit(txn).get());
             } catch (zk::transaction_failed& e) {
                 auto real_index = e.failed_op_index();
-                size_t user_index = std::distance(boundaries.begin(),
-                                                  std::lower_bound(boundaries.begin(), boundaries.end(), real_index));
+                size_t user_index = std::distance(ends.begin(),
+                                                  std::upper_bound(ends.begin(), ends.end(), real_index));
 
                 // if the failed op is a part of a complex one, repeat
-                if (boundaries[user_index] != real_index) continue;
-                else throw TxnFailed{user_index};
+                if (ends[user_index] - 1 != real_index) continue;
+
+                // if a read key has changed since it was read, repeat
+                if (user_index < transaction.checks.size()) {
+                    if (transaction.checks[user_index].kind != TxnCheck::Kind::VERSION) continue;
+                } else if (reads.count(user_index - transaction.checks.size()) &&
+                           !derived_reads.count(user_index - transaction.checks.size())) {
+                    continue;
+                }
+                throw TxnFailed{user_index};
             } catch (zk::error& e) {
                 rethrow_(e);
             }
 
             std::vector<TxnOpResult> result;
-            for (const auto& res : *raw_result) {
-                switch (res.type()) {
-                    case zk::op_type::set:
-                        result.push_back(TxnOpResult{
-                            TxnOpResult::Kind::SET,
-                            static_cast<int64_t>(res.as_set().stat().data_version.value) + 1
-                        });
-                        break;
-                    case zk::op_type::create:
-                        result.push_back(TxnOpResult{
-                            TxnOpResult::Kind::CREATE,
-                            1
-                        });
-                        break;
-                    case zk::op_type::check:
-                    case zk::op_type::erase:
-                        break;
+            // the versions written by the creates and sets, for the reads that follow them
+            std::map<const TxnOp*, int64_t> written_versions;
+            size_t raw_index = transaction.checks.empty() ? 0 : ends[transaction.checks.size() - 1];
+            for (size_t i = 0; i < transaction.ops.size(); ++i) {
+                const size_t end = ends[transaction.checks.size() + i];
+                if (auto derived = derived_reads.find(i); derived != derived_reads.end() && !reads.count(i)) {
+                    const auto* write = derived->second;
+                    result.push_back(TxnOpResult{
+                        TxnOpResult::Kind::GET,
+                        written_versions.at(write),
+                        std::visit([](auto&& arg) -> std::string {
+                            using T = std::decay_t<decltype(arg)>;
+                            if constexpr (std::is_same_v<T, TxnOpCreate> || std::is_same_v<T, TxnOpSet>)
+                                return arg.value;
+                            else
+                                return {};
+                        }, *write)
+                    });
+                    continue;
+                }
+                if (auto read = reads.find(i); read != reads.end()) {
+                    result.push_back(std::move(read->second));
+                    raw_index = std::max(raw_index, end);
+                    continue;
+                }
+                for (; raw_index < end; ++raw_index) {
+                    const auto& res = (*raw_result)[raw_index];
+                    switch (res.type()) {
+                        case zk::op_type::set:
+                            result.push_back(TxnOpResult{
+                                TxnOpResult::Kind::SET,
+                                static_cast<int64_t>(res.as_set().stat().data_version.value) + 1
+                            });
+                            written_versions[&transaction.ops[i]] = result.back().version;
+                            break;
+                        case zk::op_type::create:
+                            result.push_back(TxnOpResult{
+                                TxnOpResult::Kind::CREATE,
+                                1
+                            });
+                            written_versions[&transaction.ops[i]] = 1;
+                            break;
+                        case zk::op_type::check:
+                        case zk::op_type::erase:
+                            break;
+                    }
                 }
             }
 
             return result;
         }
+
+        throw ServiceError("the keys read by the transaction keep changing");
     }
+
+    // ephemeral nodes belong to the ZooKeeper session, whose heartbeats are sent by the zk
+    // library itself and are not observable through zkpp, so there is nothing to report
+    void set_lease_warning_handler(std::chrono::milliseconds, LeaseWarningHandler) override
+    {}
 };
 
 } // namespace liboffkv
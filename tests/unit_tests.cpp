@@ -4,6 +4,7 @@
 #include <mutex>
 #include <thread>
 #include <iostream>
+#include <set>
 
 
 TEST_F(ClientFixture, key_validation_test)
@@ -43,6 +44,25 @@ TEST_F(ClientFixture, key_validation_test)
     ASSERT_NO_THROW(check_key("/.../.../zookeper"));
 }
 
+
+TEST_F(ClientFixture, key_template_test)
+{
+    static constexpr liboffkv::KeyTemplate node_key("/services/{}/nodes/{}");
+    static_assert(node_key.placeholders() == 2);
+
+    ASSERT_EQ(static_cast<std::string>(node_key.make("db", 42)), "/services/db/nodes/42");
+    ASSERT_EQ(static_cast<std::string>(node_key.make(std::string("db"), "main")), "/services/db/nodes/main");
+
+    ASSERT_THROW(node_key.make("db"),             liboffkv::InvalidKey);
+    ASSERT_THROW(node_key.make("db", "a/b"),      liboffkv::InvalidKey);
+    ASSERT_THROW(node_key.make("", 1),            liboffkv::InvalidKey);
+    ASSERT_THROW(node_key.make("zookeeper", 1),   liboffkv::InvalidKey);
+    ASSERT_THROW(node_key.make("..", 1),          liboffkv::InvalidKey);
+
+    ASSERT_THROW(liboffkv::KeyTemplate("/one/{}x"), liboffkv::InvalidKey);
+    ASSERT_THROW(liboffkv::KeyTemplate("/one//{}"), liboffkv::InvalidKey);
+}
+
 TEST_F(ClientFixture, create_large_test)
 {
     auto holder = hold_keys("/key");
@@ -67,6 +87,36 @@ TEST_F(ClientFixture, create_test)
     ASSERT_NO_THROW(client->create("/key/child", "value"));
 }
 
+TEST_F(ClientFixture, create_sequential_test)
+{
+    auto holder = hold_keys("/key");
+
+    ASSERT_THROW(client->create_sequential("/key", "value"), liboffkv::NoEntry);
+
+    client->create("/key", "value");
+
+    std::vector<std::string> names;
+    for (int i = 0; i < 3; ++i) {
+        names.push_back(client->create_sequential("/key", "value" + std::to_string(i)));
+        if (i) {
+            ASSERT_LT(names[i - 1], names[i]);
+        }
+    }
+
+    ASSERT_EQ(client->get("/key/" + names[1]).value, "value1");
+
+    // the names keep growing after the greatest child is erased
+    const auto erased = names.back();
+    client->erase("/key/" + erased);
+    names.back() = client->create_sequential("/key", "value");
+    ASSERT_LT(erased, names.back());
+
+    std::vector<std::string> expected;
+    for (const auto& name : names) expected.push_back("/key/" + name);
+    ASSERT_TRUE(liboffkv::detail::equal_as_unordered(client->get_children("/key").children, expected));
+}
+
+
 TEST_F(ClientFixture, exists_test)
 {
     auto holder = hold_keys("/key");
@@ -162,6 +212,112 @@ TEST_F(ClientFixture, create_with_lease_test)
 }
 
 
+// polls the key until it is erased or the timeout runs out, returns whether it is gone
+static bool wait_until_erased(const std::string& key, std::chrono::seconds timeout)
+{
+    using namespace std::chrono_literals;
+
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (ClientFixture::client->exists(key)) {
+        if (std::chrono::steady_clock::now() >= deadline)
+            return false;
+        std::this_thread::sleep_for(250ms);
+    }
+    return true;
+}
+
+
+TEST_F(ClientFixture, create_with_lease_groups_test)
+{
+    if (liboffkv::detail::split_url(SERVICE_ADDRESS).first == "zk")
+        GTEST_SKIP() << "ZooKeeper ephemeral nodes all go with the session";
+
+    auto holder = hold_keys("/short", "/long");
+    using namespace std::chrono_literals;
+
+    {
+        auto local_client = liboffkv::open(SERVICE_ADDRESS, "/unitTests");
+        // the backends raise a TTL below their minimum to it
+        ASSERT_NO_THROW(local_client->create("/short", "value", liboffkv::Lease(1s)));
+        ASSERT_NO_THROW(local_client->commit({{}, {liboffkv::TxnOpCreate("/long", "value", liboffkv::Lease(300s))}}));
+
+        ASSERT_TRUE(client->exists("/short"));
+        ASSERT_TRUE(client->exists("/long"));
+    }
+
+    // Consul may keep an expired session for up to twice its TTL
+    ASSERT_TRUE(wait_until_erased("/short", 60s));
+    ASSERT_TRUE(client->exists("/long"));
+}
+
+
+TEST_F(ClientFixture, create_with_ttl_test)
+{
+    auto holder = hold_keys("/key");
+    using namespace std::chrono_literals;
+
+    {
+        auto local_client = liboffkv::open(SERVICE_ADDRESS, "/unitTests");
+        try {
+            // the backends raise a TTL below their minimum to it
+            local_client->create("/key", "value", 1s);
+        } catch (liboffkv::ServiceError&) {
+            // not supported by the backend
+            return;
+        }
+    }
+
+    // the key does not depend on the client that created it
+    ASSERT_TRUE(client->exists("/key"));
+
+    // Consul may keep an expired session for up to twice its TTL
+    ASSERT_TRUE(wait_until_erased("/key", 60s));
+}
+
+
+TEST_F(ClientFixture, lease_warning_handler_test)
+{
+    if (liboffkv::detail::split_url(SERVICE_ADDRESS).first == "zk")
+        GTEST_SKIP() << "ZooKeeper session heartbeats are not reported";
+
+    auto holder = hold_keys("/key");
+    using namespace std::chrono_literals;
+
+    std::mutex lock;
+    std::vector<liboffkv::LeaseStatus> reports;
+
+    auto local_client = liboffkv::open(SERVICE_ADDRESS, "/unitTests");
+    // any margin is below an hour, so every renewal is reported
+    local_client->set_lease_warning_handler(1h, [&](const liboffkv::LeaseStatus& status) {
+        std::lock_guard guard(lock);
+        reports.push_back(status);
+    });
+    ASSERT_NO_THROW(local_client->create("/key", "value", true));
+
+    // the first renewal is due well before the lease expires
+    const auto deadline = std::chrono::steady_clock::now() + liboffkv::Lease::DEFAULT_TTL;
+    while (std::chrono::steady_clock::now() < deadline) {
+        {
+            std::lock_guard guard(lock);
+            if (!reports.empty())
+                break;
+        }
+        std::this_thread::sleep_for(100ms);
+    }
+
+    local_client->set_lease_warning_handler(0ms, nullptr);
+    ASSERT_TRUE(client->exists("/key"));
+
+    std::lock_guard guard(lock);
+    ASSERT_FALSE(reports.empty());
+    for (const auto& status : reports) {
+        ASSERT_FALSE(status.lost);
+        ASSERT_GT(status.margin.count(), 0);
+        ASSERT_LE(status.margin, liboffkv::Lease::DEFAULT_TTL);
+    }
+}
+
+
 TEST_F(ClientFixture, get_test)
 {
     auto holder = hold_keys("/key");
@@ -178,6 +334,29 @@ TEST_F(ClientFixture, get_test)
 }
 
 
+TEST_F(ClientFixture, get_if_changed_test)
+{
+    auto holder = hold_keys("/key");
+
+    ASSERT_THROW(client->get_if_changed("/key", 1), liboffkv::NoEntry);
+
+    client->create("/key", "value");
+    auto result = client->get_if_changed("/key", 0);
+    ASSERT_TRUE(result.changed());
+    ASSERT_EQ(*result.value, "value");
+
+    auto same = client->get_if_changed("/key", result.version);
+    ASSERT_FALSE(same.changed());
+    ASSERT_EQ(same.version, result.version);
+
+    int64_t new_version = client->set("/key", "new value");
+    auto changed = client->get_if_changed("/key", result.version);
+    ASSERT_TRUE(changed.changed());
+    ASSERT_EQ(*changed.value, "new value");
+    ASSERT_EQ(changed.version, new_version);
+}
+
+
 TEST_F(ClientFixture, set_test)
 {
     auto holder = hold_keys("/key");
@@ -227,6 +406,43 @@ TEST_F(ClientFixture, get_with_watch_test)
 }
 
 
+TEST_F(ClientFixture, watch_value_test)
+{
+    auto holder = hold_keys("/key");
+
+    ASSERT_THROW(client->watch_value("/key"), liboffkv::NoEntry);
+
+    client->create("/key", "value");
+
+    std::mutex my_lock;
+    my_lock.lock();
+
+    int64_t new_version = 0;
+    auto thread = std::thread([&my_lock, &new_version]() mutable {
+        std::lock_guard<std::mutex> lock_guard(my_lock);
+        new_version = client->set("/key", "newValue");
+    });
+
+    auto result = client->watch_value("/key");
+    my_lock.unlock();
+
+    ASSERT_EQ(result.value, "value");
+
+    auto change = result.watch->wait();
+
+    thread.join();
+
+    ASSERT_TRUE(change);
+    ASSERT_EQ(change.value, "newValue");
+    ASSERT_EQ(change.version, new_version);
+
+    result = client->watch_value("/key");
+    client->erase("/key");
+
+    ASSERT_FALSE(result.watch->wait());
+}
+
+
 TEST_F(ClientFixture, cas_test)
 {
     auto holder = hold_keys("/key");
@@ -241,6 +457,8 @@ TEST_F(ClientFixture, cas_test)
     ASSERT_NO_THROW(cas_result = client->cas("/key", "new_value", version + 1));
 
     ASSERT_FALSE(cas_result);
+    ASSERT_EQ(cas_result.current_version, version);
+    ASSERT_EQ(cas_result.current_value, "value");
 
     get_result = client->get("/key");
     ASSERT_EQ(get_result.version, version);
@@ -276,6 +494,8 @@ TEST_F(ClientFixture, cas_zero_version_test)
     ASSERT_NO_THROW(cas_result = client->cas("/key", "new_value"));
 
     ASSERT_FALSE(cas_result);
+    ASSERT_EQ(cas_result.current_version, version);
+    ASSERT_EQ(cas_result.current_value, "value");
 
     ASSERT_NO_THROW(get_result = client->get("/key"));
     ASSERT_EQ(get_result.value, "value");
@@ -347,6 +567,150 @@ TEST_F(ClientFixture, get_children_with_watch_test)
 }
 
 
+TEST_F(ClientFixture, get_children_query_test)
+{
+    auto holder = hold_keys("/key");
+    using Order = liboffkv::ChildrenQuery::Order;
+
+    ASSERT_THROW(client->get_children("/key", liboffkv::ChildrenQuery{Order::ASCEND, 1}), liboffkv::NoEntry);
+
+    client->create("/key", "value");
+    for (auto child : {"b", "d", "a", "c"})
+        client->create(std::string("/key/") + child, "value");
+    client->create("/key/a/grandchild", "value");
+
+    using Children = std::vector<std::string>;
+    ASSERT_EQ(client->get_children("/key", liboffkv::ChildrenQuery{Order::ASCEND, 1}), Children{"/key/a"});
+    ASSERT_EQ(client->get_children("/key", liboffkv::ChildrenQuery{Order::DESCEND, 2}), (Children{"/key/d", "/key/c"}));
+    ASSERT_EQ(client->get_children("/key", liboffkv::ChildrenQuery{Order::ASCEND, 0}),
+              (Children{"/key/a", "/key/b", "/key/c", "/key/d"}));
+    ASSERT_EQ(client->get_children("/key", liboffkv::ChildrenQuery{Order::NONE, 3}).size(), 3u);
+}
+
+
+TEST_F(ClientFixture, stat_test)
+{
+    auto holder = hold_keys("/key");
+
+    ASSERT_THROW(client->stat("/key"), liboffkv::NoEntry);
+
+    client->create("/key", "value");
+    client->create("/key/child", "value");
+    client->create("/key/child/grandchild", "value");
+    client->create("/key/leased", "value", true);
+
+    liboffkv::StatResult result;
+    ASSERT_NO_THROW(result = client->stat("/key"));
+    ASSERT_EQ(result.version, client->get("/key").version);
+    ASSERT_EQ(result.children_count, 2u);
+    ASSERT_TRUE(result.owner.empty());
+    if (result.value_size) {
+        ASSERT_EQ(*result.value_size, 5u);
+    }
+
+    int64_t new_version = client->set("/key", "new value");
+    auto changed = client->stat("/key");
+    ASSERT_EQ(changed.version, new_version);
+    ASSERT_EQ(changed.create_revision, result.create_revision);
+    ASSERT_GT(changed.modify_revision, result.modify_revision);
+
+    ASSERT_FALSE(client->stat("/key/leased").owner.empty());
+}
+
+
+TEST_F(ClientFixture, count_children_test)
+{
+    auto holder = hold_keys("/key");
+
+    ASSERT_THROW(client->count_children("/key"), liboffkv::NoEntry);
+    ASSERT_THROW(client->count_subtree("/key"), liboffkv::NoEntry);
+
+    client->create("/key", "value");
+    ASSERT_EQ(client->count_children("/key"), 0u);
+    ASSERT_EQ(client->count_subtree("/key"), 0u);
+
+    client->create("/key/child", "value");
+    client->create("/key/child/grandchild", "value");
+    client->create("/key/child/grandchild/greatgrandchild", "value");
+    client->create("/key/hackerivan", "value");
+    client->create_sequential("/key", "value");
+
+    ASSERT_EQ(client->count_children("/key"), 3u);
+    ASSERT_EQ(client->count_subtree("/key"), 5u);
+    ASSERT_EQ(client->count_children("/key/child"), 1u);
+    ASSERT_EQ(client->count_subtree("/key/child"), 2u);
+}
+
+
+TEST_F(ClientFixture, watch_children_test)
+{
+    auto holder = hold_keys("/key");
+
+    ASSERT_THROW(client->watch_children("/key"), liboffkv::NoEntry);
+
+    client->create("/key", "value");
+    client->create("/key/child", "value");
+    client->create("/key/dimak24", "value");
+
+    auto result = client->watch_children("/key");
+
+    ASSERT_TRUE(liboffkv::detail::equal_as_unordered(
+        result.children,
+        {"/key/child", "/key/dimak24"}
+    ));
+
+    client->create("/key/child/grandchild", "value");
+    client->set("/key/child", "new_value");
+    client->create("/key/hackerivan", "value");
+    client->erase("/key/dimak24");
+
+    std::vector<std::string> added, removed;
+    while (added.size() + removed.size() < 2) {
+        auto delta = result.watch->wait();
+        added.insert(added.end(), delta.added.begin(), delta.added.end());
+        removed.insert(removed.end(), delta.removed.begin(), delta.removed.end());
+    }
+
+    ASSERT_EQ(added, std::vector<std::string>{"/key/hackerivan"});
+    ASSERT_EQ(removed, std::vector<std::string>{"/key/dimak24"});
+
+    // the watch ends once the parent is erased, possibly after reporting its children gone
+    client->erase("/key");
+    ASSERT_THROW(while (true) result.watch->wait(), liboffkv::NoEntry);
+}
+
+
+TEST_F(ClientFixture, watch_subtree_test)
+{
+    auto holder = hold_keys("/key");
+
+    ASSERT_THROW(client->watch_subtree("/key"), liboffkv::NoEntry);
+
+    client->create("/key", "value");
+    client->create("/key/child", "value");
+
+    auto watch = client->watch_subtree("/key");
+
+    int64_t version = client->create("/key/child/grandchild", "value");
+
+    auto changes = watch->wait();
+    ASSERT_EQ(changes.size(), 1);
+    ASSERT_EQ(changes[0].key, "/key/child/grandchild");
+    ASSERT_EQ(changes[0].version, version);
+
+    client->erase("/key/child");
+
+    std::set<std::string> erased;
+    while (erased.size() < 2) {
+        for (const auto& change : watch->wait()) {
+            ASSERT_EQ(change.version, 0);
+            erased.insert(change.key);
+        }
+    }
+    ASSERT_EQ(erased, (std::set<std::string>{"/key/child", "/key/child/grandchild"}));
+}
+
+
 TEST_F(ClientFixture, commit_test)
 {
     auto holder = hold_keys("/key", "/foo");
@@ -440,6 +804,274 @@ TEST_F(ClientFixture, commit_test)
     ASSERT_GT(result.at(1).version, key_version);
 }
 
+TEST_F(ClientFixture, txn_read_test)
+{
+    auto holder = hold_keys("/key");
+
+    auto key_version = client->create("/key", "value");
+    client->create("/key/child", "value");
+    client->create("/key/child/grandchild", "value");
+    client->create("/key/hackerivan", "value");
+
+    // reading a missing key fails the transaction
+    try {
+        client->commit({{}, {liboffkv::TxnOpGet("/key"), liboffkv::TxnOpGet("/key/missing")}});
+        FAIL() << "Expected commit to throw TxnFailed, but it threw nothing";
+    } catch (liboffkv::TxnFailed &e) {
+        ASSERT_EQ(e.failed_op(), 1);
+    } catch (std::exception &e) {
+        FAIL() << "Expected commit to throw TxnFailed, but it threw different exception:\n" << e.what();
+    }
+
+    liboffkv::TransactionResult result;
+    ASSERT_NO_THROW(result = client->commit(
+        {
+            {
+                liboffkv::TxnCheck("/key", key_version),
+            },
+            {
+                liboffkv::TxnOpGet("/key"),
+                liboffkv::TxnOpGetChildren("/key"),
+                liboffkv::TxnOpSet("/key/child", "new_value"),
+            }
+        }
+    ));
+
+    ASSERT_EQ(result.size(), 3);
+    ASSERT_EQ(result[0].kind, liboffkv::TxnOpResult::Kind::GET);
+    ASSERT_EQ(result[0].value, "value");
+    ASSERT_EQ(result[0].version, key_version);
+    ASSERT_EQ(result[1].kind, liboffkv::TxnOpResult::Kind::GET_CHILDREN);
+    ASSERT_TRUE(liboffkv::detail::equal_as_unordered(
+        result[1].children,
+        {"/key/child", "/key/hackerivan"}
+    ));
+    ASSERT_EQ(result[2].kind, liboffkv::TxnOpResult::Kind::SET);
+
+    // a key written earlier in the transaction is read after the write
+    ASSERT_NO_THROW(result = client->commit(
+        {{}, {liboffkv::TxnOpSet("/key", "written"), liboffkv::TxnOpGet("/key")}}));
+    ASSERT_EQ(result.size(), 2);
+    ASSERT_EQ(result[1].kind, liboffkv::TxnOpResult::Kind::GET);
+    ASSERT_EQ(result[1].value, "written");
+}
+
+TEST_F(ClientFixture, txn_value_check_test)
+{
+    auto holder = hold_keys("/key", "/foo");
+
+    client->create("/key", "token:42");
+    client->create("/foo", "value");
+
+    try {
+        client->commit(
+            {
+                {
+                    liboffkv::TxnCheck("/key", liboffkv::TxnCheck::Kind::VALUE_PREFIX, "token:"),
+                    liboffkv::TxnCheck("/foo", liboffkv::TxnCheck::Kind::VALUE, "other_value"),
+                },
+                {
+                    liboffkv::TxnOpSet("/foo", "new_value"),
+                }
+            }
+        );
+        FAIL() << "Expected commit to throw TxnFailed, but it threw nothing";
+    } catch (liboffkv::TxnFailed &e) {
+        ASSERT_EQ(e.failed_op(), 1);
+    } catch (std::exception &e) {
+        FAIL() << "Expected commit to throw TxnFailed, but it threw different exception:\n" << e.what();
+    }
+
+    ASSERT_EQ(client->get("/foo").value, "value");
+
+    ASSERT_NO_THROW(client->commit(
+        {
+            {
+                liboffkv::TxnCheck("/key", liboffkv::TxnCheck::Kind::VALUE_PREFIX, "token:"),
+                liboffkv::TxnCheck("/foo", liboffkv::TxnCheck::Kind::VALUE, "value"),
+            },
+            {
+                liboffkv::TxnOpSet("/foo", "new_value"),
+            }
+        }
+    ));
+
+    ASSERT_EQ(client->get("/foo").value, "new_value");
+}
+
+TEST_F(ClientFixture, transact_test)
+{
+    auto holder = hold_keys("/counter", "/lazy");
+
+    client->create("/counter", "0");
+
+    const auto increment = [](liboffkv::TransactionContext &context) {
+        const auto value = std::stoi(context.get("/counter")) + 1;
+        context.set("/counter", std::to_string(value));
+        return value;
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i)
+        threads.emplace_back([&] {
+            for (int j = 0; j < 5; ++j)
+                client->transact(increment);
+        });
+    for (auto &thread : threads)
+        thread.join();
+
+    ASSERT_EQ(client->get("/counter").value, "20");
+    ASSERT_EQ(client->transact(increment), 21);
+
+    ASSERT_THROW(client->transact([](liboffkv::TransactionContext &context) {
+        context.create("/counter", "0");
+    }), liboffkv::TxnFailed);
+
+    // a key read as missing must still be missing at commit
+    const auto increment_or_create = [](liboffkv::TransactionContext &context) {
+        try {
+            context.set("/lazy", std::to_string(std::stoi(context.get("/lazy")) + 1));
+        } catch (liboffkv::NoEntry&) {
+            context.create("/lazy", "1");
+        }
+    };
+
+    threads.clear();
+    for (int i = 0; i < 4; ++i)
+        threads.emplace_back([&] {
+            for (int j = 0; j < 5; ++j)
+                client->transact(increment_or_create);
+        });
+    for (auto &thread : threads)
+        thread.join();
+
+    ASSERT_EQ(client->get("/lazy").value, "20");
+}
+
+TEST_F(ClientFixture, prepared_transaction_test)
+{
+    auto holder = hold_keys("/key");
+
+    auto version = client->create("/key", "value");
+
+    auto prepared = client->prepare(
+        {
+            {
+                liboffkv::TxnCheck("/key", 0),
+            },
+            {
+                liboffkv::TxnOpSet("/key", ""),
+            }
+        }
+    );
+
+    liboffkv::TransactionResult result;
+    ASSERT_NO_THROW(result = prepared->commit({version}, {"first"}));
+    ASSERT_EQ(client->get("/key").value, "first");
+
+    ASSERT_THROW(prepared->commit({version}, {"second"}), liboffkv::TxnFailed);
+    ASSERT_EQ(client->get("/key").value, "first");
+
+    ASSERT_NO_THROW(result = prepared->commit({result.at(0).version}, {"second"}));
+    ASSERT_EQ(client->get("/key").value, "second");
+
+    ASSERT_THROW(prepared->commit({version}, {}), std::invalid_argument);
+}
+
+TEST_F(ClientFixture, commit_view_test)
+{
+    auto holder = hold_keys("/key");
+
+    auto version = client->create("/key", "value");
+    const std::string large_value(1 << 16, 'x');
+
+    const liboffkv::TxnCheckView checks[] = {
+        {"/key", version},
+    };
+    const liboffkv::TxnOpView ops[] = {
+        {liboffkv::TxnOpView::Kind::CREATE, "/key/child", large_value},
+        {liboffkv::TxnOpView::Kind::SET, "/key", "new_value"},
+    };
+
+    liboffkv::TransactionResult result;
+    ASSERT_NO_THROW(result = client->commit(liboffkv::TransactionView{checks, 1, ops, 2}));
+    ASSERT_EQ(result.size(), 2);
+    ASSERT_EQ(client->get("/key/child").value, large_value);
+    ASSERT_EQ(client->get("/key").value, "new_value");
+
+    ASSERT_THROW(client->commit(liboffkv::TransactionView{checks, 1, ops, 2}), liboffkv::TxnFailed);
+}
+
+template <class TypedClient>
+static void check_basic_client(const std::string &url, liboffkv::Client &client)
+{
+    TypedClient typed(url, "/unitTests");
+
+    auto version = typed.create("/key", "value");
+    ASSERT_EQ(client.get("/key").version, version);
+    ASSERT_EQ(typed.get("/key").value, "value");
+}
+
+TEST_F(ClientFixture, basic_client_test)
+{
+    auto holder = hold_keys("/key");
+
+    const std::string url = SERVICE_ADDRESS;
+    const auto protocol = liboffkv::detail::split_url(url).first;
+#ifdef ENABLE_ZK
+    if (protocol == "zk") check_basic_client<liboffkv::zk_client>(url, *client);
+    else ASSERT_THROW(liboffkv::zk_client{url}, liboffkv::InvalidAddress);
+#endif
+#ifdef ENABLE_CONSUL
+    if (protocol == "consul") check_basic_client<liboffkv::consul_client>(url, *client);
+    else ASSERT_THROW(liboffkv::consul_client{url}, liboffkv::InvalidAddress);
+#endif
+#ifdef ENABLE_ETCD
+    if (protocol == "etcd") check_basic_client<liboffkv::etcd_client>(url, *client);
+    else ASSERT_THROW(liboffkv::etcd_client{url}, liboffkv::InvalidAddress);
+#endif
+}
+
+TEST_F(ClientFixture, pmr_results_test)
+{
+    auto holder = hold_keys("/key");
+
+    // too long for the small string buffer, so the strings have to allocate
+    const std::string value(100, 'v');
+    const std::string child = "/key/" + std::string(40, 'c');
+
+    auto version = client->create("/key", value);
+    client->create(child, value);
+
+    // everything has to fit into the buffer, the upstream resource refuses to allocate
+    char buffer[16384];
+    std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+
+    const auto get_result = client->get("/key", &arena);
+    ASSERT_EQ(get_result.version, version);
+    ASSERT_EQ(std::string_view(get_result.value), value);
+    ASSERT_EQ(get_result.value.get_allocator().resource(), &arena);
+
+    const auto children = client->get_children("/key", &arena);
+    ASSERT_EQ(children.get_allocator().resource(), &arena);
+    ASSERT_EQ(children.size(), 1);
+    ASSERT_EQ(std::string_view(children[0]), child);
+    ASSERT_EQ(children[0].get_allocator().resource(), &arena);
+
+    const auto result = client->commit(
+        {{}, {liboffkv::TxnOpGet("/key"), liboffkv::TxnOpGetChildren("/key")}}, &arena);
+    ASSERT_EQ(result.get_allocator().resource(), &arena);
+    ASSERT_EQ(result.size(), 2);
+    ASSERT_EQ(std::string_view(result[0].value), value);
+    ASSERT_EQ(result[0].value.get_allocator().resource(), &arena);
+    ASSERT_EQ(result[1].children.get_allocator().resource(), &arena);
+    ASSERT_EQ(result[1].children.size(), 1);
+    ASSERT_EQ(std::string_view(result[1].children[0]), child);
+    ASSERT_EQ(result[1].children[0].get_allocator().resource(), &arena);
+
+    ASSERT_THROW(client->get("/missing", &arena), liboffkv::NoEntry);
+}
+
 TEST_F(ClientFixture, erase_prefix_test)
 {
     auto holder = hold_keys("/ichi", "/ichinichi");